@@ -1,97 +1,284 @@
 #include "cache.h"
+#include "deps/sds/sds.h"
+#include "rm_parser.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <kvec.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
 
-#define CACHE_SIZE 128
+#define CACHE_MIN_BUCKETS 256
 
-static cache_entry *cache_head = NULL;
-static cache_entry *cache_tail = NULL;
-static int cache_count = 0;
+typedef struct {
+  cache_entry *head;
+  cache_entry *tail;
+} cache_list;
+
+// Entries are indexed by (uuid, type) in a chained hash table. Each tier
+// keeps its unpinned entries on an LRU list and evicts from its tail once
+// the tier's bytes exceed its budget; entries held by an open file or a
+// render are on the tier's pinned list and never evicted.
+typedef struct {
+  cache_list lru;
+  cache_list pinned;
+  size_t bytes;
+  const size_t *max_bytes;
+} cache_tier;
+
+size_t cache_max_bytes = DEFAULT_CACHE_MAX_BYTES;
+size_t parsed_cache_max_bytes = DEFAULT_PARSED_CACHE_MAX_BYTES;
+char *cache_dir = NULL;
+size_t cache_dir_max_bytes = DEFAULT_CACHE_DIR_MAX_BYTES;
+
+static cache_entry **buckets = NULL;
+static size_t num_buckets = 0;
+static size_t cache_count = 0;
+static cache_tier tiers[2] = {{.max_bytes = &cache_max_bytes},
+                              {.max_bytes = &parsed_cache_max_bytes}};
 static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-cache_entry *get_cached_entry(const char *uuid, const char *type,
-                              time_t mtime) {
-  pthread_mutex_lock(&cache_mutex);
-  cache_entry *curr = cache_head;
-  while (curr) {
-    if (strcmp(curr->uuid, uuid) == 0 && strcmp(curr->type, type) == 0) {
-      if (curr->mtime == mtime) {
-        if (curr != cache_head) {
-          curr->prev->next = curr->next;
-          if (curr->next)
-            curr->next->prev = curr->prev;
-          else
-            cache_tail = curr->prev;
-          curr->next = cache_head;
-          curr->prev = NULL;
-          cache_head->prev = curr;
-          cache_head = curr;
-        }
-        curr->refcount++;
-        pthread_mutex_unlock(&cache_mutex);
-        return curr;
-      }
-      if (curr->prev)
-        curr->prev->next = curr->next;
-      else
-        cache_head = curr->next;
-      if (curr->next)
-        curr->next->prev = curr->prev;
-      else
-        cache_tail = curr->prev;
-      if (curr->refcount == 0) {
-        free(curr->data);
-        free(curr);
+static uint32_t key_hash(const char *uuid, const char *type) {
+  uint32_t h = 2166136261u;
+  for (const char *p = uuid; *p; p++)
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  h = (h ^ '/') * 16777619u;
+  for (const char *p = type; *p; p++)
+    h = (h ^ (uint8_t)*p) * 16777619u;
+  return h;
+}
+
+static void list_remove(cache_list *l, cache_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    l->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    l->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void list_push(cache_list *l, cache_entry *e) {
+  e->prev = NULL;
+  e->next = l->head;
+  if (l->head)
+    l->head->prev = e;
+  l->head = e;
+  if (!l->tail)
+    l->tail = e;
+}
+
+static void grow_buckets(void) {
+  size_t n = num_buckets ? num_buckets * 2 : CACHE_MIN_BUCKETS;
+  cache_entry **nb = calloc(n, sizeof(cache_entry *));
+  if (!nb)
+    return;
+  for (size_t i = 0; i < num_buckets; i++) {
+    cache_entry *e = buckets[i];
+    while (e) {
+      cache_entry *next = e->hnext;
+      e->hnext = nb[e->hash & (n - 1)];
+      nb[e->hash & (n - 1)] = e;
+      e = next;
+    }
+  }
+  free(buckets);
+  buckets = nb;
+  num_buckets = n;
+}
+
+// Takes e out of the index. Pinned entries are only marked dead and freed
+// by the last release_cached_entry.
+static void unlink_entry(cache_entry *e) {
+  cache_entry **pp = &buckets[e->hash & (num_buckets - 1)];
+  while (*pp != e)
+    pp = &(*pp)->hnext;
+  *pp = e->hnext;
+  e->hnext = NULL;
+  cache_tier *t = &tiers[e->tier];
+  list_remove(e->refcount > 0 ? &t->pinned : &t->lru, e);
+  cache_count--;
+  t->bytes -= e->size;
+  if (e->refcount == 0) {
+    free(e->data);
+    free(e);
+  } else {
+    e->uuid[0] = '\0';
+  }
+}
+
+static void evict_over_budget(cache_tier *t) {
+  // The pages the parser keeps to resume them count against parsed pages.
+  size_t held = t == &tiers[1] ? remfmt_resume_size() : 0;
+  while (t->bytes + held > *t->max_bytes && t->lru.tail)
+    unlink_entry(t->lru.tail);
+}
+
+static cache_entry *lookup_entry(const char *uuid, const char *type,
+                                 uint64_t version) {
+  if (!num_buckets)
+    return NULL;
+  uint32_t h = key_hash(uuid, type);
+  for (cache_entry *e = buckets[h & (num_buckets - 1)]; e; e = e->hnext) {
+    if (e->hash != h || strcmp(e->uuid, uuid) != 0 ||
+        strcmp(e->type, type) != 0)
+      continue;
+    if (e->version != version) {
+      unlink_entry(e);
+      return NULL;
+    }
+    if (e->refcount == 0) {
+      list_remove(&tiers[e->tier].lru, e);
+      list_push(&tiers[e->tier].pinned, e);
+    }
+    e->refcount++;
+    return e;
+  }
+  return NULL;
+}
+
+// A render in progress for one (uuid, type, version). Whoever claimed it
+// publishes through add_to_cache or gives up through abandon_cache_claim;
+// anyone else asking for the same key sleeps on cond until then.
+typedef struct cache_flight {
+  char uuid[64];
+  char type[8];
+  uint64_t version;
+  bool done;
+  int waiters;
+  pthread_cond_t cond;
+  struct cache_flight *next;
+} cache_flight;
+
+static cache_flight *flights = NULL;
+
+static cache_flight *find_flight(const char *uuid, const char *type,
+                                 uint64_t version) {
+  for (cache_flight *f = flights; f; f = f->next) {
+    if (f->version == version && strcmp(f->uuid, uuid) == 0 &&
+        strcmp(f->type, type) == 0)
+      return f;
+  }
+  return NULL;
+}
+
+static void end_flight(const char *uuid, const char *type, uint64_t version) {
+  cache_flight **pp = &flights;
+  while (*pp) {
+    cache_flight *f = *pp;
+    if (f->version == version && strcmp(f->uuid, uuid) == 0 &&
+        strcmp(f->type, type) == 0) {
+      *pp = f->next;
+      f->done = true;
+      if (f->waiters > 0) {
+        pthread_cond_broadcast(&f->cond);
       } else {
-        curr->uuid[0] = '\0';
+        pthread_cond_destroy(&f->cond);
+        free(f);
       }
-      cache_count--;
+      return;
+    }
+    pp = &f->next;
+  }
+}
+
+cache_entry *get_cached_entry(const char *uuid, const char *type,
+                              uint64_t version) {
+  pthread_mutex_lock(&cache_mutex);
+  cache_entry *entry = lookup_entry(uuid, type, version);
+  pthread_mutex_unlock(&cache_mutex);
+  return entry;
+}
+
+cache_entry *claim_cached_entry(const char *uuid, const char *type,
+                                uint64_t version) {
+  pthread_mutex_lock(&cache_mutex);
+  for (;;) {
+    cache_entry *entry = lookup_entry(uuid, type, version);
+    if (entry) {
+      pthread_mutex_unlock(&cache_mutex);
+      return entry;
+    }
+    cache_flight *f = find_flight(uuid, type, version);
+    if (!f)
       break;
+    f->waiters++;
+    while (!f->done)
+      pthread_cond_wait(&f->cond, &cache_mutex);
+    if (--f->waiters == 0) {
+      pthread_cond_destroy(&f->cond);
+      free(f);
     }
-    curr = curr->next;
+    // Either the entry is published now or the render failed and we get
+    // to try it ourselves.
+  }
+
+  cache_flight *f = calloc(1, sizeof(cache_flight));
+  if (f) {
+    strcpy(f->uuid, uuid);
+    strcpy(f->type, type);
+    f->version = version;
+    pthread_cond_init(&f->cond, NULL);
+    f->next = flights;
+    flights = f;
   }
   pthread_mutex_unlock(&cache_mutex);
   return NULL;
 }
 
-cache_entry *add_to_cache(const char *uuid, const char *type, time_t mtime,
+void abandon_cache_claim(const char *uuid, const char *type, uint64_t version) {
+  pthread_mutex_lock(&cache_mutex);
+  end_flight(uuid, type, version);
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+cache_entry *add_to_cache(const char *uuid, const char *type, uint64_t version,
                           uint8_t *data, size_t size) {
-  cache_entry *entry = calloc(1, sizeof(cache_entry));
+  pthread_mutex_lock(&cache_mutex);
+  end_flight(uuid, type, version);
+
+  // A render that raced past the claim may already have published this key;
+  // keep the first copy so readers share one buffer.
+  cache_entry *existing = lookup_entry(uuid, type, version);
+  if (existing) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(data);
+    return existing;
+  }
+
+  // Failing to grow only lengthens the chains, unless there is no table yet.
+  if (cache_count >= num_buckets)
+    grow_buckets();
+  cache_entry *entry = num_buckets ? calloc(1, sizeof(cache_entry)) : NULL;
+  if (!entry) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(data);
+    return NULL;
+  }
   strcpy(entry->uuid, uuid);
   strcpy(entry->type, type);
-  entry->mtime = mtime;
+  entry->version = version;
   entry->data = data;
   entry->size = size;
   entry->refcount = 1;
+  entry->hash = key_hash(uuid, type);
+  entry->tier = strcmp(type, PARSED_TYPE) == 0;
 
-  pthread_mutex_lock(&cache_mutex);
-  entry->next = cache_head;
-  if (cache_head)
-    cache_head->prev = entry;
-  cache_head = entry;
-  if (!cache_tail)
-    cache_tail = entry;
+  entry->hnext = buckets[entry->hash & (num_buckets - 1)];
+  buckets[entry->hash & (num_buckets - 1)] = entry;
+  cache_tier *t = &tiers[entry->tier];
+  list_push(&t->pinned, entry);
   cache_count++;
+  t->bytes += size;
 
-  while (cache_count > CACHE_SIZE) {
-    cache_entry *tail = cache_tail;
-    if (!tail)
-      break;
-    cache_tail = tail->prev;
-    if (cache_tail)
-      cache_tail->next = NULL;
-    else
-      cache_head = NULL;
-
-    if (tail->refcount == 0) {
-      free(tail->data);
-      free(tail);
-    } else {
-      tail->uuid[0] = '\0';
-    }
-    cache_count--;
-  }
+  evict_over_budget(t);
   pthread_mutex_unlock(&cache_mutex);
   return entry;
 }
@@ -99,9 +286,192 @@ cache_entry *add_to_cache(const char *uuid, const char *type, time_t mtime,
 void release_cached_entry(cache_entry *entry) {
   pthread_mutex_lock(&cache_mutex);
   entry->refcount--;
-  if (entry->refcount == 0 && entry->uuid[0] == '\0') {
-    free(entry->data);
-    free(entry);
+  if (entry->refcount == 0) {
+    if (entry->uuid[0] == '\0') {
+      free(entry->data);
+      free(entry);
+    } else {
+      cache_tier *t = &tiers[entry->tier];
+      list_remove(&t->pinned, entry);
+      list_push(&t->lru, entry);
+      evict_over_budget(t);
+    }
+  }
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+// The disk tier stores one file per render, named by its version digest and
+// type. A file's mtime is bumped on every hit, so the sweep can drop the
+// least recently used ones once the directory outgrows cache_dir_max_bytes.
+static pthread_mutex_t disk_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool disk_scanned = false;
+static size_t disk_bytes = 0;
+
+typedef struct {
+  time_t mtime;
+  size_t size;
+  sds path;
+} disk_file;
+
+static sds disk_path(uint64_t version, const char *type) {
+  return sdscatprintf(sdsempty(), "%s/%016llx.%s", cache_dir,
+                      (unsigned long long)version, type);
+}
+
+static int cmp_disk_file(const void *a, const void *b) {
+  const disk_file *fa = a, *fb = b;
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// Recounts the directory and, if it is over budget, deletes the oldest
+// files until it is back under 90% of it. Temp files left behind by a crash
+// are removed once they are an hour old. Index snapshots (index-*.bin, see
+// remfs.c) share the directory but are neither counted nor swept.
+static void sweep_disk_cache(void) {
+  DIR *dir = opendir(cache_dir);
+  if (!dir)
+    return;
+  kvec_t(disk_file) files;
+  kv_init(files);
+  size_t total = 0;
+  time_t now = time(NULL);
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 ||
+        strncmp(de->d_name, "index-", 6) == 0)
+      continue;
+    sds path = sdscatprintf(sdsempty(), "%s/%s", cache_dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+      sdsfree(path);
+      continue;
+    }
+    if (de->d_name[0] == '.') {
+      if (now - st.st_mtime > 3600)
+        unlink(path);
+      sdsfree(path);
+      continue;
+    }
+    disk_file f = {st.st_mtime, (size_t)st.st_size, path};
+    kv_push(disk_file, files, f);
+    total += f.size;
+  }
+  closedir(dir);
+
+  if (total > cache_dir_max_bytes) {
+    qsort(files.a, kv_size(files), sizeof(disk_file), cmp_disk_file);
+    size_t target = cache_dir_max_bytes - cache_dir_max_bytes / 10;
+    for (size_t i = 0; i < kv_size(files) && total > target; i++) {
+      if (unlink(kv_A(files, i).path) == 0)
+        total -= kv_A(files, i).size;
+    }
+  }
+  for (size_t i = 0; i < kv_size(files); i++)
+    sdsfree(kv_A(files, i).path);
+  kv_destroy(files);
+  disk_bytes = total;
+}
+
+cache_entry *load_disk_cache(const char *uuid, const char *type,
+                             uint64_t version) {
+  if (!cache_dir)
+    return NULL;
+  sds path = disk_path(version, type);
+  uint8_t *data = NULL;
+  size_t size = 0;
+  int fd = open(path, O_RDONLY);
+  if (fd != -1) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      size = st.st_size;
+      data = malloc(size);
+      size_t got = 0;
+      while (data && got < size) {
+        ssize_t n = read(fd, data + got, size - got);
+        if (n <= 0)
+          break;
+        got += n;
+      }
+      if (data && got != size) {
+        free(data);
+        data = NULL;
+      }
+    }
+    close(fd);
+  }
+  if (data)
+    utimes(path, NULL);
+  sdsfree(path);
+  if (!data)
+    return NULL;
+  return add_to_cache(uuid, type, version, data, size);
+}
+
+bool cached_render_size(const char *uuid, const char *type, uint64_t version,
+                        size_t *size) {
+  bool found = false;
+  pthread_mutex_lock(&cache_mutex);
+  if (num_buckets) {
+    uint32_t h = key_hash(uuid, type);
+    for (cache_entry *e = buckets[h & (num_buckets - 1)]; e; e = e->hnext) {
+      if (e->hash == h && e->version == version && strcmp(e->uuid, uuid) == 0 &&
+          strcmp(e->type, type) == 0) {
+        *size = e->size;
+        __atomic_store_n(&e->size_reported, true, __ATOMIC_RELAXED);
+        found = true;
+        break;
+      }
+    }
   }
   pthread_mutex_unlock(&cache_mutex);
+  if (found || !cache_dir)
+    return found;
+
+  sds path = disk_path(version, type);
+  struct stat st;
+  if (stat(path, &st) == 0 && st.st_size > 0) {
+    *size = st.st_size;
+    found = true;
+  }
+  sdsfree(path);
+  return found;
+}
+
+void store_disk_cache(uint64_t version, const char *type, const uint8_t *data,
+                      size_t size) {
+  if (!cache_dir || !data || size == 0)
+    return;
+  pthread_mutex_lock(&disk_mutex);
+  if (!disk_scanned) {
+    mkdir(cache_dir, 0755);
+    sweep_disk_cache();
+    disk_scanned = true;
+  }
+
+  sds tmp = sdscatprintf(sdsempty(), "%s/.%016llx.%s.XXXXXX", cache_dir,
+                         (unsigned long long)version, type);
+  int fd = mkstemp(tmp);
+  if (fd != -1) {
+    size_t put = 0;
+    while (put < size) {
+      ssize_t n = write(fd, data + put, size - put);
+      if (n <= 0)
+        break;
+      put += n;
+    }
+    bool ok = put == size && fsync(fd) == 0;
+    close(fd);
+    sds path = disk_path(version, type);
+    if (ok && rename(tmp, path) == 0) {
+      disk_bytes += size;
+    } else {
+      unlink(tmp);
+    }
+    sdsfree(path);
+  }
+  sdsfree(tmp);
+
+  if (disk_bytes > cache_dir_max_bytes)
+    sweep_disk_cache();
+  pthread_mutex_unlock(&disk_mutex);
 }
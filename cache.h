@@ -1,24 +1,70 @@
 #ifndef CACHE_H
 #define CACHE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <time.h>
 
+// Renders are keyed by (uuid, type, version), where version is a digest of
+// every input that shapes the output (see generators.h).
 typedef struct cache_entry {
   char uuid[64];
   char type[8];
-  time_t mtime;
+  uint64_t version;
   uint8_t *data;
   size_t size;
   int refcount;
+  uint32_t hash;
+  // Which budget the entry counts against: 0 for renders, 1 for parsed pages.
+  uint8_t tier;
+  // Set once cached_render_size has reported this entry's size, so getattr
+  // may have told the kernel the right size. Read with __atomic builtins.
+  bool size_reported;
+  struct cache_entry *hnext;
   struct cache_entry *prev;
   struct cache_entry *next;
 } cache_entry;
 
-cache_entry *get_cached_entry(const char *uuid, const char *type, time_t mtime);
-cache_entry *add_to_cache(const char *uuid, const char *type, time_t mtime,
+#define DEFAULT_CACHE_MAX_BYTES ((size_t)512 * 1024 * 1024)
+#define DEFAULT_CACHE_DIR_MAX_BYTES ((size_t)2 * 1024 * 1024 * 1024)
+#define DEFAULT_PARSED_CACHE_MAX_BYTES ((size_t)64 * 1024 * 1024)
+
+// Parsed pages are cached under this type, keyed by page uuid and a digest
+// of their .rm, so the renders of one page in several formats parse it once.
+// data is the remfmt_stroke_vec remfmt_parse returned, which is a single
+// allocation. They never go to the disk tier.
+#define PARSED_TYPE "strokes"
+
+// Budget for bytes held by cached renders; set from config at startup.
+extern size_t cache_max_bytes;
+// Budget for parsed pages, kept apart from that of renders.
+extern size_t parsed_cache_max_bytes;
+// Optional on-disk tier behind the in-memory cache; NULL disables it.
+extern char *cache_dir;
+extern size_t cache_dir_max_bytes;
+
+cache_entry *get_cached_entry(const char *uuid, const char *type,
+                              uint64_t version);
+// Like get_cached_entry, but on a miss either waits for a render of the same
+// key already in progress or returns NULL to make the caller its owner. The
+// owner must finish with add_to_cache or abandon_cache_claim.
+cache_entry *claim_cached_entry(const char *uuid, const char *type,
+                                uint64_t version);
+void abandon_cache_claim(const char *uuid, const char *type, uint64_t version);
+cache_entry *add_to_cache(const char *uuid, const char *type, uint64_t version,
                           uint8_t *data, size_t size);
 void release_cached_entry(cache_entry *entry);
 
+// Publishes the render stored on disk under version, if any, as though it had
+// been passed to add_to_cache. Returns NULL on a disk miss.
+cache_entry *load_disk_cache(const char *uuid, const char *type,
+                             uint64_t version);
+// Size of the render stored under (uuid, type, version) in either tier,
+// found without loading or pinning it.
+bool cached_render_size(const char *uuid, const char *type, uint64_t version,
+                        size_t *size);
+// Writes a render to the disk tier atomically (temp file plus rename).
+void store_disk_cache(uint64_t version, const char *type, const uint8_t *data,
+                      size_t size);
+
 #endif /* CACHE_H */
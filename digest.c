@@ -0,0 +1,282 @@
+#include "digest.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const uint8_t *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+         (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+         (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * P1 + P4;
+}
+
+static void consume_stripe(digest_state *st, const uint8_t *p) {
+  st->v[0] = xxh_round(st->v[0], read64(p));
+  st->v[1] = xxh_round(st->v[1], read64(p + 8));
+  st->v[2] = xxh_round(st->v[2], read64(p + 16));
+  st->v[3] = xxh_round(st->v[3], read64(p + 24));
+}
+
+void digest_init(digest_state *st) {
+  memset(st, 0, sizeof(*st));
+  st->v[0] = P1 + P2;
+  st->v[1] = P2;
+  st->v[2] = 0;
+  st->v[3] = -P1;
+}
+
+void digest_update(digest_state *st, const void *data, size_t len) {
+  const uint8_t *p = data;
+  st->total += len;
+
+  if (st->buflen + len < 32) {
+    memcpy(st->buf + st->buflen, p, len);
+    st->buflen += len;
+    return;
+  }
+  if (st->buflen) {
+    size_t fill = 32 - st->buflen;
+    memcpy(st->buf + st->buflen, p, fill);
+    consume_stripe(st, st->buf);
+    p += fill;
+    len -= fill;
+    st->buflen = 0;
+  }
+  while (len >= 32) {
+    consume_stripe(st, p);
+    p += 32;
+    len -= 32;
+  }
+  memcpy(st->buf, p, len);
+  st->buflen = len;
+}
+
+uint64_t digest_final(const digest_state *st) {
+  uint64_t h;
+  if (st->total >= 32) {
+    h = rotl(st->v[0], 1) + rotl(st->v[1], 7) + rotl(st->v[2], 12) +
+        rotl(st->v[3], 18);
+    for (int i = 0; i < 4; i++)
+      h = xxh_merge(h, st->v[i]);
+  } else {
+    h = P5;
+  }
+  h += st->total;
+
+  const uint8_t *p = st->buf;
+  size_t len = st->buflen;
+  while (len >= 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl(h, 27) * P1 + P4;
+    p += 8;
+    len -= 8;
+  }
+  if (len >= 4) {
+    h ^= (uint64_t)read32(p) * P1;
+    h = rotl(h, 23) * P2 + P3;
+    p += 4;
+    len -= 4;
+  }
+  while (len > 0) {
+    h ^= (*p) * P5;
+    h = rotl(h, 11) * P1;
+    p++;
+    len--;
+  }
+
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+uint64_t digest_bytes(const void *data, size_t len) {
+  digest_state st;
+  digest_init(&st);
+  digest_update(&st, data, len);
+  return digest_final(&st);
+}
+
+void digest_string(digest_state *st, const char *s) {
+  if (!s)
+    s = "";
+  digest_update(st, s, strlen(s) + 1);
+}
+
+int digest_file(digest_state *st, const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return -1;
+  uint8_t chunk[65536];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+    digest_update(st, chunk, n);
+  int err = ferror(f) ? -1 : 0;
+  fclose(f);
+  return err;
+}
+
+typedef struct file_memo {
+  char *path;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint64_t digest;
+  size_t bucket;
+  struct file_memo *next;
+  struct file_memo *lru_prev, *lru_next;
+} file_memo;
+
+#define MEMO_BUCKETS 4096
+// Paths remembered at most. The least recently used are dropped first, so
+// pages since deleted or moved do not stay for the life of the mount.
+#define MEMO_MAX 16384
+
+static file_memo *memo_buckets[MEMO_BUCKETS];
+static file_memo *memo_head, *memo_tail;
+static size_t memo_count;
+static pthread_mutex_t memo_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void memo_unlink(file_memo *m) {
+  if (m->lru_prev)
+    m->lru_prev->lru_next = m->lru_next;
+  else
+    memo_head = m->lru_next;
+  if (m->lru_next)
+    m->lru_next->lru_prev = m->lru_prev;
+  else
+    memo_tail = m->lru_prev;
+}
+
+static void memo_push(file_memo *m) {
+  m->lru_prev = NULL;
+  m->lru_next = memo_head;
+  if (memo_head)
+    memo_head->lru_prev = m;
+  else
+    memo_tail = m;
+  memo_head = m;
+}
+
+// The entry for path in bucket b, if any, made the most recently used.
+static file_memo *memo_find(size_t b, const char *path) {
+  file_memo *m = memo_buckets[b];
+  while (m && strcmp(m->path, path) != 0)
+    m = m->next;
+  if (m && m != memo_head) {
+    memo_unlink(m);
+    memo_push(m);
+  }
+  return m;
+}
+
+static void memo_evict(void) {
+  file_memo *m = memo_tail;
+  file_memo **pp = &memo_buckets[m->bucket];
+  while (*pp != m)
+    pp = &(*pp)->next;
+  *pp = m->next;
+  memo_unlink(m);
+  memo_count--;
+  free(m->path);
+  free(m);
+}
+
+static bool memo_matches(const file_memo *m, const struct stat *st) {
+  return m->dev == st->st_dev && m->ino == st->st_ino &&
+         m->size == st->st_size && m->mtime.tv_sec == st->st_mtim.tv_sec &&
+         m->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+int digest_file_memo(const char *path, uint64_t *out) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return -1;
+
+  size_t b = digest_bytes(path, strlen(path)) % MEMO_BUCKETS;
+  pthread_mutex_lock(&memo_mutex);
+  file_memo *m = memo_find(b, path);
+  if (m && memo_matches(m, &st)) {
+    *out = m->digest;
+    pthread_mutex_unlock(&memo_mutex);
+    return 0;
+  }
+  pthread_mutex_unlock(&memo_mutex);
+
+  digest_state ds;
+  digest_init(&ds);
+  if (digest_file(&ds, path) != 0)
+    return -1;
+  *out = digest_final(&ds);
+
+  pthread_mutex_lock(&memo_mutex);
+  m = memo_find(b, path);
+  if (!m) {
+    m = calloc(1, sizeof(file_memo));
+    if (m)
+      m->path = strdup(path);
+    if (m && m->path) {
+      m->bucket = b;
+      m->next = memo_buckets[b];
+      memo_buckets[b] = m;
+      memo_push(m);
+      if (++memo_count > MEMO_MAX)
+        memo_evict();
+    } else {
+      free(m);
+      m = NULL;
+    }
+  }
+  if (m) {
+    m->dev = st.st_dev;
+    m->ino = st.st_ino;
+    m->size = st.st_size;
+    m->mtime = st.st_mtim;
+    m->digest = *out;
+  }
+  pthread_mutex_unlock(&memo_mutex);
+  return 0;
+}
+
+int digest_file_indexed(const char *path, int64_t size, int64_t mtime_ns,
+                        uint64_t *out) {
+  size_t b = digest_bytes(path, strlen(path)) % MEMO_BUCKETS;
+  pthread_mutex_lock(&memo_mutex);
+  file_memo *m = memo_find(b, path);
+  bool hit = m && m->size == size &&
+             (int64_t)m->mtime.tv_sec * 1000000000 + m->mtime.tv_nsec ==
+                 mtime_ns;
+  if (hit)
+    *out = m->digest;
+  pthread_mutex_unlock(&memo_mutex);
+  return hit ? 0 : -1;
+}
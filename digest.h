@@ -0,0 +1,34 @@
+#ifndef DIGEST_H
+#define DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming XXH64 (seed 0), used to key renders by the bytes they were made
+// from.
+typedef struct {
+  uint64_t v[4];
+  uint64_t total;
+  uint8_t buf[32];
+  size_t buflen;
+} digest_state;
+
+void digest_init(digest_state *st);
+void digest_update(digest_state *st, const void *data, size_t len);
+uint64_t digest_final(const digest_state *st);
+uint64_t digest_bytes(const void *data, size_t len);
+
+// Feeds a NUL-terminated string, terminator included, so that adjacent
+// fields cannot run into each other. NULL hashes like "".
+void digest_string(digest_state *st, const char *s);
+// Feeds the contents of a file; returns -1 if it cannot be read.
+int digest_file(digest_state *st, const char *path);
+// Digest of a file's contents, rehashed only when its inode, size or
+// nanosecond mtime differ from the last call for the same path.
+int digest_file_memo(const char *path, uint64_t *out);
+// The digest digest_file_memo last made of path, if the file then had the
+// size and mtime_ns the index recorded; -1 otherwise. Never reads the file.
+int digest_file_indexed(const char *path, int64_t size, int64_t mtime_ns,
+                        uint64_t *out);
+
+#endif /* DIGEST_H */
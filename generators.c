@@ -1,57 +1,219 @@
 #include "generators.h"
+#include "digest.h"
 #include "path_utils.h"
 #include "pdfoverlay.h"
 #include "remfmt.h"
 #include "remfuse.h"
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
-bool pdf_has_annotations(remfs_ctx *ctx, uuid_map_node *ref) {
-  if (!ref || !ref->file || ref->file->filetype != PDF) {
-    return false;
+// pdfoverlay keeps its object table in globals, so overlays from concurrent
+// renders have to take turns.
+static pthread_mutex_t overlay_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Part of every render version. Bump it whenever a renderer's output changes
+// so renders cached on disk by an older build are not served.
+#define RENDER_CACHE_VERSION 3
+
+static void digest_params(digest_state *st, remfs_file *file, bool anot) {
+  uint8_t flags[2] = {file->landscape, anot};
+  int canvas[2] = {DEV_W, DEV_H};
+  digest_string(st, template_dir);
+  digest_string(st, file->template_name);
+  digest_update(st, flags, sizeof(flags));
+  digest_update(st, canvas, sizeof(canvas));
+}
+
+static void digest_source(digest_state *st, const char *path) {
+  uint64_t d = 0;
+  uint8_t present = digest_file_memo(path, &d) == 0;
+  digest_update(st, &present, sizeof(present));
+  digest_update(st, &d, sizeof(d));
+}
+
+// Like digest_source for a page's .rm, but with indexed set it takes the
+// digest the memo holds for the size and mtime in the index, and returns
+// false rather than read the file when there is none.
+static bool digest_rm(digest_state *st, const char *path, remfs_file *page,
+                      bool indexed) {
+  if (!indexed) {
+    digest_source(st, path);
+    return true;
   }
+  uint64_t d = 0;
+  if (digest_file_indexed(path, page->rm_size, page->mtime_ns, &d) == -1)
+    return false;
+  uint8_t present = 1;
+  digest_update(st, &present, sizeof(present));
+  digest_update(st, &d, sizeof(d));
+  return true;
+}
+
+static bool digest_page(digest_state *st, remfs_ctx *ctx, uuid_map_node *doc,
+                        uuid_map_node *page, bool anot, bool indexed) {
+  sds rm_path = sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
+                             doc->file->uuid, page->file->uuid);
+  bool known = digest_rm(st, rm_path, page->file, indexed);
+  digest_params(st, page->file, anot);
+  sdsfree(rm_path);
+  return known;
+}
+
+// The pages of a document, in order, as its PDFs are keyed by them. An
+// annotated PDF also keys the page names, which pick the PDF page each
+// overlay lands on. With indexed set the result is kept on the document's
+// record, so later lookups need not visit every page.
+static bool pages_digest(remfs_ctx *ctx, uuid_map_node *ref, bool anot,
+                         bool indexed, uint64_t *out) {
+  uint64_t *kept = &ref->file->pages_version[anot];
+  if (indexed && (*out = __atomic_load_n(kept, __ATOMIC_RELAXED)))
+    return true;
+  digest_state dst;
+  digest_init(&dst);
   for (size_t i = 0; i < kv_size(ref->children); i++) {
     uuid_map_node *page = kv_A(ref->children, i);
     if (!page || page->file->filetype != PAGE)
       continue;
-    sds rm_path = sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
-                               ref->file->uuid, page->file->uuid);
-    struct stat st;
-    if (stat(rm_path, &st) == 0 && st.st_size > 43) {
-      sdsfree(rm_path);
-      return true;
-    }
-    sdsfree(rm_path);
+    if (anot)
+      digest_string(&dst, page->file->visible_name);
+    if (!digest_page(&dst, ctx, ref, page, anot, indexed))
+      return false;
   }
-  return false;
+  *out = digest_final(&dst);
+  if (indexed)
+    __atomic_store_n(kept, *out, __ATOMIC_RELAXED);
+  return true;
 }
 
-bool has_annotations(const char *src_dir, remfs_file *file) {
-  sds rmpath = sdscatprintf(sdsempty(), "%s/%s/%s.rm", src_dir, file->parent,
-                            file->uuid);
-  struct stat st;
-  if (stat(rmpath, &st) == -1) {
-    sdsfree(rmpath);
+static void digest_begin(digest_state *st, const char *kind) {
+  uint32_t version = RENDER_CACHE_VERSION;
+  digest_init(st);
+  digest_update(st, &version, sizeof(version));
+  digest_string(st, kind);
+}
+
+// The versions below come in two flavours. getattr only looks renders up,
+// and keys them by the page stat data held in the index; renders key what
+// they produce by the files as they find them.
+static bool annotated_version(remfs_ctx *ctx, uuid_map_node *ref,
+                              const char *orig_pdf_path, bool indexed,
+                              uint64_t *version) {
+  uint64_t pages;
+  if (!pages_digest(ctx, ref, true, indexed, &pages))
     return false;
-  }
-  if (st.st_size <= 43) {
-    sdsfree(rmpath);
+  digest_state dst;
+  digest_begin(&dst, "annotated.pdf");
+  digest_source(&dst, orig_pdf_path);
+  int zoom[3] = {ref->file->margins, ref->file->custom_zoom_page_width,
+                 ref->file->custom_zoom_page_height};
+  digest_update(&dst, zoom, sizeof(zoom));
+  digest_update(&dst, &pages, sizeof(pages));
+  *version = digest_final(&dst);
+  return true;
+}
+
+static bool notebook_version(remfs_ctx *ctx, uuid_map_node *ref, bool indexed,
+                             uint64_t *version) {
+  uint64_t pages;
+  if (!pages_digest(ctx, ref, false, indexed, &pages))
     return false;
-  }
+  digest_state dst;
+  digest_begin(&dst, "notebook.pdf");
+  digest_update(&dst, &pages, sizeof(pages));
+  *version = digest_final(&dst);
+  return true;
+}
+
+static bool fake_ext_digest(uuid_map_node *ref, const char *rmpath, bool anot,
+                            const char *ext, bool indexed, uint64_t *version) {
+  digest_state dst;
+  digest_begin(&dst, ext);
+  if (!digest_rm(&dst, rmpath, ref->file,
+                 indexed && ref->file->filetype == PAGE))
+    return false;
+  digest_params(&dst, ref->file, anot);
+  *version = digest_final(&dst);
+  return true;
+}
 
-  bool has_strokes = false;
+bool annotated_pdf_version(remfs_ctx *ctx, uuid_map_node *ref,
+                           const char *orig_pdf_path, uint64_t *version) {
+  return annotated_version(ctx, ref, orig_pdf_path, true, version);
+}
+
+bool notebook_pdf_version(remfs_ctx *ctx, uuid_map_node *ref,
+                          uint64_t *version) {
+  return notebook_version(ctx, ref, true, version);
+}
+
+bool fake_ext_version(uuid_map_node *ref, const char *rmpath, bool anot,
+                      const char *ext, uint64_t *version) {
+  return fake_ext_digest(ref, rmpath, anot, ext, true, version);
+}
+
+static uint64_t parsed_version(const char *rmpath) {
+  digest_state dst;
+  digest_begin(&dst, PARSED_TYPE);
+  digest_source(&dst, rmpath);
+  return digest_final(&dst);
+}
+
+// The strokes of the page at rmpath, from the parsed tier of the cache or,
+// with parse set, parsed into it. NULL on a miss or if the page does not
+// parse. Release the entry once done with its strokes.
+static cache_entry *parsed_page(remfs_file *page, const char *rmpath,
+                                bool parse) {
+  uint64_t version = parsed_version(rmpath);
+  if (!parse)
+    return get_cached_entry(page->uuid, PARSED_TYPE, version);
+  cache_entry *entry = claim_cached_entry(page->uuid, PARSED_TYPE, version);
+  if (entry)
+    return entry;
   remfmt_stroke_vec *strokes = remfmt_parse(rmpath);
-  if (strokes) {
-    if (kv_size(*strokes) > 0) {
-      has_strokes = true;
-    }
-    remfmt_stroke_cleanup(strokes);
+  if (!strokes) {
+    abandon_cache_claim(page->uuid, PARSED_TYPE, version);
+    return NULL;
   }
+  // The parse settles has_annotations for the page, so it need not probe.
+  if (page->filetype == PAGE)
+    __atomic_store_n(&page->strokes,
+                     kv_size(*strokes) > 0 ? STROKES_PRESENT : STROKES_NONE,
+                     __ATOMIC_RELAXED);
+  return add_to_cache(page->uuid, PARSED_TYPE, version, (uint8_t *)strokes,
+                      remfmt_stroke_size(strokes));
+}
 
+bool pdf_has_annotations(remfs_ctx *ctx, uuid_map_node *ref) {
+  if (!ref || !ref->file || ref->file->filetype != PDF) {
+    return false;
+  }
+  for (size_t i = 0; i < kv_size(ref->children); i++) {
+    uuid_map_node *page = kv_A(ref->children, i);
+    if (page && page->file->filetype == PAGE && page->file->rm_size > 43)
+      return true;
+  }
+  return false;
+}
+
+bool has_annotations(const char *src_dir, remfs_file *file) {
+  // Anything up to the 43-byte header holds no strokes.
+  if (file->rm_size <= 43)
+    return false;
+  uint8_t known = __atomic_load_n(&file->strokes, __ATOMIC_RELAXED);
+  if (known != STROKES_UNKNOWN)
+    return known == STROKES_PRESENT;
+
+  sds rmpath = sdscatprintf(sdsempty(), "%s/%s/%s.rm", src_dir, file->parent,
+                            file->uuid);
+  remfmt_info info;
+  bool has_strokes = remfmt_probe(rmpath, &info) && info.num_strokes > 0;
   sdsfree(rmpath);
+  __atomic_store_n(&file->strokes, has_strokes ? STROKES_PRESENT : STROKES_NONE,
+                   __ATOMIC_RELAXED);
   return has_strokes;
 }
 
@@ -65,23 +227,13 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
     return NULL;
   }
 
-  time_t latest_mtime = st.st_mtime;
-  for (size_t i = 0; i < kv_size(ref->children); i++) {
-    uuid_map_node *page = kv_A(ref->children, i);
-    if (!page || page->file->filetype != PAGE)
-      continue;
-    sds rm_path = sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
-                               ref->file->uuid, page->file->uuid);
-    struct stat rm_st;
-    if (stat(rm_path, &rm_st) == 0) {
-      if (rm_st.st_mtime > latest_mtime) {
-        latest_mtime = rm_st.st_mtime;
-      }
-    }
-    sdsfree(rm_path);
+  uint64_t version;
+  annotated_version(ctx, ref, orig_pdf_path, false, &version);
+  cache_entry *cached = claim_cached_entry(ref->file->uuid, "pdf", version);
+  if (cached) {
+    return cached;
   }
-
-  cache_entry *cached = get_cached_entry(ref->file->uuid, "pdf", latest_mtime);
+  cached = load_disk_cache(ref->file->uuid, "pdf", version);
   if (cached) {
     return cached;
   }
@@ -107,8 +259,9 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
         FILE *png_fp = fdopen(png_fd, "wb");
         if (png_fp) {
           int overlay_margins = 0;
-          remfmt_stroke_vec *strokes = remfmt_parse(rm_path);
-          if (strokes) {
+          cache_entry *parsed = parsed_page(page->file, rm_path, true);
+          if (parsed) {
+            remfmt_stroke_vec *strokes = (remfmt_stroke_vec *)parsed->data;
             sds asset_dir = sdscatprintf(sdsempty(), "%s/%s", ctx->src_dir,
                                          ref->file->uuid);
             remfmt_render_params prm = {.landscape = page->file->landscape,
@@ -130,7 +283,7 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
 
             remfmt_render_png(png_fp, strokes, &prm);
             sdsfree(asset_dir);
-            remfmt_stroke_cleanup(strokes);
+            release_cached_entry(parsed);
           }
           fclose(png_fp);
 
@@ -141,9 +294,11 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
           int pdf_fd = mkstemp(pdf_tmp_path);
           if (pdf_fd != -1) {
             close(pdf_fd);
+            pthread_mutex_lock(&overlay_mutex);
             int err =
                 pdf_overlay_png(current_pdf, png_tmp_path, pdf_tmp_path,
                                 actual_page_num, 0, 0, 0, 0, overlay_margins);
+            pthread_mutex_unlock(&overlay_mutex);
             if (err == 0) {
               if (strcmp(current_pdf, orig_pdf_path) != 0) {
                 unlink(current_pdf);
@@ -173,11 +328,15 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
   sdsfree(current_pdf);
 
   if (!final_data) {
+    abandon_cache_claim(ref->file->uuid, "pdf", version);
     return NULL;
   }
 
-  return add_to_cache(ref->file->uuid, "pdf", latest_mtime, final_data,
-                      final_size);
+  cache_entry *entry = add_to_cache(ref->file->uuid, "pdf", version,
+                                    final_data, final_size);
+  if (entry)
+    store_disk_cache(version, "pdf", entry->data, entry->size);
+  return entry;
 }
 
 cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
@@ -189,16 +348,13 @@ cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
     }
   }
 
-  sds meta_path =
-      sdscatprintf(sdsempty(), "%s/%s.metadata", ctx->src_dir, ref->file->uuid);
-  struct stat meta_st;
-  time_t latest_mtime = 1;
-  if (stat(meta_path, &meta_st) == 0) {
-    latest_mtime = meta_st.st_mtime;
+  uint64_t version;
+  notebook_version(ctx, ref, false, &version);
+  cache_entry *cached = claim_cached_entry(ref->file->uuid, "pdf", version);
+  if (cached) {
+    return cached;
   }
-  sdsfree(meta_path);
-
-  cache_entry *cached = get_cached_entry(ref->file->uuid, "pdf", latest_mtime);
+  cached = load_disk_cache(ref->file->uuid, "pdf", version);
   if (cached) {
     return cached;
   }
@@ -206,9 +362,15 @@ cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
   uint8_t *data = NULL;
   size_t size = 0;
   FILE *sh = open_memstream((char **)&data, &size);
-  if (!sh)
+  if (!sh) {
+    abandon_cache_claim(ref->file->uuid, "pdf", version);
     return NULL;
+  }
 
+  sds *rm_paths = calloc(page_count, sizeof(sds));
+  // Pages parsed for other renders are drawn from the cache; the rest are
+  // streamed from their files rather than parsed whole.
+  cache_entry **parsed = calloc(page_count, sizeof(cache_entry *));
   remfmt_stroke_vec **pages_strokes =
       calloc(page_count, sizeof(remfmt_stroke_vec *));
   remfmt_render_params **pages_prms =
@@ -218,10 +380,11 @@ cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
   for (size_t i = 0; i < kv_size(ref->children); i++) {
     uuid_map_node *page = kv_A(ref->children, i);
     if (page && page->file->filetype == PAGE) {
-      sds rm_path = sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
-                                 ref->file->uuid, page->file->uuid);
-      pages_strokes[idx] = remfmt_parse(rm_path);
-      sdsfree(rm_path);
+      rm_paths[idx] = sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
+                                   ref->file->uuid, page->file->uuid);
+      parsed[idx] = parsed_page(page->file, rm_paths[idx], false);
+      if (parsed[idx])
+        pages_strokes[idx] = (remfmt_stroke_vec *)parsed[idx]->data;
 
       pages_prms[idx] = malloc(sizeof(remfmt_render_params));
       pages_prms[idx]->landscape = page->file->landscape;
@@ -234,12 +397,16 @@ cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
     }
   }
 
-  remfmt_render_notebook_pdf(sh, page_count, pages_strokes, pages_prms);
+  remfmt_render_notebook_pdf(sh, page_count, (const char **)rm_paths,
+                             pages_strokes, pages_prms);
   fclose(sh);
 
   for (int i = 0; i < page_count; i++) {
-    if (pages_strokes[i]) {
-      remfmt_stroke_cleanup(pages_strokes[i]);
+    if (rm_paths[i]) {
+      sdsfree(rm_paths[i]);
+    }
+    if (parsed[i]) {
+      release_cached_entry(parsed[i]);
     }
     if (pages_prms[i]) {
       if (pages_prms[i]->asset_dir) {
@@ -248,10 +415,42 @@ cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref) {
       free(pages_prms[i]);
     }
   }
+  free(rm_paths);
+  free(parsed);
   free(pages_strokes);
   free(pages_prms);
 
-  return add_to_cache(ref->file->uuid, "pdf", latest_mtime, data, size);
+  cache_entry *entry =
+      add_to_cache(ref->file->uuid, "pdf", version, data, size);
+  if (entry)
+    store_disk_cache(version, "pdf", entry->data, entry->size);
+  return entry;
+}
+
+bool fake_png_size(uuid_map_node *ref, const char *rmpath, bool anot,
+                   size_t *size) {
+  bool page = ref->file->filetype == PAGE;
+  uint32_t known =
+      page ? __atomic_load_n(&ref->file->png_size[anot], __ATOMIC_RELAXED) : 0;
+  if (known) {
+    *size = known - 1;
+    return true;
+  }
+  struct stat st;
+  if (stat(rmpath, &st) == -1)
+    return false;
+  // A page that does not parse renders to nothing at all.
+  remfmt_info info;
+  *size = 0;
+  if (remfmt_probe(rmpath, &info)) {
+    remfmt_render_params prm = {.landscape = ref->file->landscape,
+                                .annotation = anot};
+    *size = remfmt_png_size(&info, &prm);
+  }
+  if (page && *size < UINT32_MAX)
+    __atomic_store_n(&ref->file->png_size[anot], (uint32_t)*size + 1,
+                     __ATOMIC_RELAXED);
+  return true;
 }
 
 cache_entry *generate_fake_ext(uuid_map_node *ref, const char *rmpath,
@@ -260,18 +459,26 @@ cache_entry *generate_fake_ext(uuid_map_node *ref, const char *rmpath,
   if (stat(rmpath, &st) == -1)
     return NULL;
 
-  cache_entry *cached = get_cached_entry(ref->file->uuid, ext, st.st_mtime);
+  uint64_t version;
+  fake_ext_digest(ref, rmpath, anot, ext, false, &version);
+  cache_entry *cached = claim_cached_entry(ref->file->uuid, ext, version);
+  if (cached)
+    return cached;
+  cached = load_disk_cache(ref->file->uuid, ext, version);
   if (cached)
     return cached;
 
   uint8_t *data = NULL;
   size_t size = 0;
   FILE *sh = open_memstream((char **)&data, &size);
-  if (!sh)
+  if (!sh) {
+    abandon_cache_claim(ref->file->uuid, ext, version);
     return NULL;
+  }
 
-  remfmt_stroke_vec *strokes = remfmt_parse(rmpath);
-  if (strokes) {
+  cache_entry *parsed = parsed_page(ref->file, rmpath, true);
+  if (parsed) {
+    remfmt_stroke_vec *strokes = (remfmt_stroke_vec *)parsed->data;
     char *last_slash = strrchr(rmpath, '/');
     sds asset_dir = NULL;
     if (last_slash != NULL) {
@@ -295,9 +502,12 @@ cache_entry *generate_fake_ext(uuid_map_node *ref, const char *rmpath,
     if (asset_dir) {
       sdsfree(asset_dir);
     }
-    remfmt_stroke_cleanup(strokes);
+    release_cached_entry(parsed);
   }
   fclose(sh);
 
-  return add_to_cache(ref->file->uuid, ext, st.st_mtime, data, size);
+  cache_entry *entry = add_to_cache(ref->file->uuid, ext, version, data, size);
+  if (entry)
+    store_disk_cache(version, ext, entry->data, entry->size);
+  return entry;
 }
@@ -11,5 +11,20 @@ cache_entry *generate_annotated_pdf(remfs_ctx *ctx, uuid_map_node *ref,
 cache_entry *generate_notebook_pdf(remfs_ctx *ctx, uuid_map_node *ref);
 cache_entry *generate_fake_ext(uuid_map_node *ref, const char *rmpath,
                                bool anot, const char *ext);
+// Size generate_fake_ext(ref, rmpath, anot, "png") returns, found by
+// parsing the page instead of rendering it.
+bool fake_png_size(uuid_map_node *ref, const char *rmpath, bool anot,
+                   size_t *size);
+
+// Cache versions of the renders above: digests of the source bytes and
+// render settings, cheap to recompute while the sources are unchanged. Page
+// files are taken to be as the index last saw them, so no page is stat'ed
+// or read; false means a page was not digested in that state yet.
+bool annotated_pdf_version(remfs_ctx *ctx, uuid_map_node *ref,
+                           const char *orig_pdf_path, uint64_t *version);
+bool notebook_pdf_version(remfs_ctx *ctx, uuid_map_node *ref,
+                          uint64_t *version);
+bool fake_ext_version(uuid_map_node *ref, const char *rmpath, bool anot,
+                      const char *ext, uint64_t *version);
 
 #endif /* GENERATORS_H */
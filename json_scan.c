@@ -0,0 +1,318 @@
+#include "json_scan.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+void json_init(json_cursor *c, const char *text, size_t len) {
+  c->p = text;
+  c->end = text + len;
+  c->first = false;
+  // Some writers lead with a UTF-8 byte order mark.
+  if (len >= 3 && memcmp(text, "\xEF\xBB\xBF", 3) == 0)
+    c->p += 3;
+}
+
+static void skip_ws(json_cursor *c) {
+  while (c->p < c->end &&
+         (*c->p == ' ' || *c->p == '\t' || *c->p == '\n' || *c->p == '\r'))
+    c->p++;
+}
+
+static bool expect(json_cursor *c, char ch) {
+  skip_ws(c);
+  if (c->p >= c->end || *c->p != ch)
+    return false;
+  c->p++;
+  return true;
+}
+
+json_type json_peek(json_cursor *c) {
+  skip_ws(c);
+  if (c->p >= c->end)
+    return JSON_INVALID;
+  switch (*c->p) {
+  case '{':
+    return JSON_OBJECT;
+  case '[':
+    return JSON_ARRAY;
+  case '"':
+    return JSON_STRING;
+  case 't':
+    return JSON_TRUE;
+  case 'f':
+    return JSON_FALSE;
+  case 'n':
+    return JSON_NULL;
+  default:
+    if (*c->p == '-' || (*c->p >= '0' && *c->p <= '9'))
+      return JSON_NUMBER;
+    return JSON_INVALID;
+  }
+}
+
+bool json_enter_object(json_cursor *c) {
+  c->first = true;
+  return expect(c, '{');
+}
+
+bool json_enter_array(json_cursor *c) {
+  c->first = true;
+  return expect(c, '[');
+}
+
+// Members are separated by exactly one ','. Closing a container ends a
+// member of the one around it, so that one is past its first member too.
+static bool next_member(json_cursor *c, char close, bool *done) {
+  skip_ws(c);
+  if (c->p >= c->end)
+    return false;
+  *done = *c->p == close;
+  bool first = c->first;
+  c->first = false;
+  if (*done) {
+    c->p++;
+    return true;
+  }
+  if (first)
+    return *c->p != ',';
+  return expect(c, ',');
+}
+
+bool json_next_key(json_cursor *c, char *key, size_t keysz, bool *done) {
+  if (!next_member(c, '}', done))
+    return false;
+  if (*done)
+    return true;
+  return json_read_string(c, key, keysz) && expect(c, ':');
+}
+
+bool json_next_element(json_cursor *c, bool *done) {
+  if (!next_member(c, ']', done))
+    return false;
+  if (!*done && json_peek(c) == JSON_INVALID)
+    return false;
+  return true;
+}
+
+static int hex4(const char *p) {
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    char ch = p[i];
+    v <<= 4;
+    if (ch >= '0' && ch <= '9')
+      v |= ch - '0';
+    else if (ch >= 'a' && ch <= 'f')
+      v |= ch - 'a' + 10;
+    else if (ch >= 'A' && ch <= 'F')
+      v |= ch - 'A' + 10;
+    else
+      return -1;
+  }
+  return v;
+}
+
+// Appends up to four bytes, dropping whatever no longer fits.
+static void put(char *out, size_t outsz, size_t *n, const char *bytes,
+                size_t len) {
+  if (*n + len < outsz) {
+    memcpy(out + *n, bytes, len);
+    *n += len;
+  } else {
+    *n = outsz ? outsz - 1 : 0;
+  }
+}
+
+static size_t utf8_encode(uint32_t cp, char *buf) {
+  if (cp < 0x80) {
+    buf[0] = cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    buf[0] = 0xC0 | cp >> 6;
+    buf[1] = 0x80 | (cp & 0x3F);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    buf[0] = 0xE0 | cp >> 12;
+    buf[1] = 0x80 | (cp >> 6 & 0x3F);
+    buf[2] = 0x80 | (cp & 0x3F);
+    return 3;
+  }
+  buf[0] = 0xF0 | cp >> 18;
+  buf[1] = 0x80 | (cp >> 12 & 0x3F);
+  buf[2] = 0x80 | (cp >> 6 & 0x3F);
+  buf[3] = 0x80 | (cp & 0x3F);
+  return 4;
+}
+
+bool json_read_string(json_cursor *c, char *out, size_t outsz) {
+  if (!expect(c, '"'))
+    return false;
+  size_t n = 0;
+  while (c->p < c->end && *c->p != '"') {
+    const char *run = c->p;
+    while (c->p < c->end && *c->p != '"' && *c->p != '\\')
+      c->p++;
+    size_t len = c->p - run;
+    if (n + len >= outsz)
+      len = outsz ? outsz - 1 - n : 0;
+    memcpy(out + n, run, len);
+    n += len;
+    if (c->p >= c->end || *c->p == '"')
+      break;
+
+    // Escape sequence.
+    if (c->end - c->p < 2)
+      return false;
+    char esc = c->p[1], buf[4];
+    c->p += 2;
+    switch (esc) {
+    case '"':
+    case '\\':
+    case '/':
+      buf[0] = esc;
+      break;
+    case 'b':
+      buf[0] = '\b';
+      break;
+    case 'f':
+      buf[0] = '\f';
+      break;
+    case 'n':
+      buf[0] = '\n';
+      break;
+    case 'r':
+      buf[0] = '\r';
+      break;
+    case 't':
+      buf[0] = '\t';
+      break;
+    case 'u': {
+      if (c->end - c->p < 4)
+        return false;
+      int hi = hex4(c->p);
+      if (hi < 0)
+        return false;
+      c->p += 4;
+      uint32_t cp = hi;
+      if (hi >= 0xD800 && hi <= 0xDBFF) {
+        if (c->end - c->p < 6 || c->p[0] != '\\' || c->p[1] != 'u')
+          return false;
+        int lo = hex4(c->p + 2);
+        if (lo < 0xDC00 || lo > 0xDFFF)
+          return false;
+        c->p += 6;
+        cp = 0x10000 + ((hi - 0xD800) << 10) + (lo - 0xDC00);
+      } else if (hi >= 0xDC00 && hi <= 0xDFFF) {
+        return false;
+      }
+      put(out, outsz, &n, buf, utf8_encode(cp, buf));
+      continue;
+    }
+    default:
+      return false;
+    }
+    put(out, outsz, &n, buf, 1);
+  }
+  if (c->p >= c->end)
+    return false;
+  c->p++;
+  if (outsz)
+    out[n] = '\0';
+  return true;
+}
+
+bool json_read_number(json_cursor *c, double *out) {
+  skip_ws(c);
+  const char *start = c->p;
+  while (c->p < c->end && (strchr("+-.eE", *c->p) != NULL ||
+                           (*c->p >= '0' && *c->p <= '9')))
+    c->p++;
+  char buf[64];
+  size_t len = c->p - start;
+  if (len == 0 || len >= sizeof(buf))
+    return false;
+  memcpy(buf, start, len);
+  buf[len] = '\0';
+  char *endp;
+  *out = strtod(buf, &endp);
+  return endp == buf + len;
+}
+
+static bool skip_literal(json_cursor *c, const char *word) {
+  size_t len = strlen(word);
+  if ((size_t)(c->end - c->p) < len || memcmp(c->p, word, len) != 0)
+    return false;
+  c->p += len;
+  return true;
+}
+
+static bool skip_string(json_cursor *c) {
+  c->p++;
+  while (c->p < c->end) {
+    const char *q = memchr(c->p, '"', c->end - c->p);
+    if (!q)
+      return false;
+    // The quote is escaped if an odd number of backslashes precede it.
+    size_t slashes = 0;
+    while (q - slashes > c->p && q[-1 - (ptrdiff_t)slashes] == '\\')
+      slashes++;
+    c->p = q + 1;
+    if (slashes % 2 == 0)
+      return true;
+  }
+  return false;
+}
+
+bool json_skip(json_cursor *c) {
+  // Containers are skipped by counting brackets rather than recursing, so
+  // deep redo histories cost neither stack nor calls.
+  int depth = 0;
+  do {
+    skip_ws(c);
+    if (c->p >= c->end)
+      return false;
+    double num;
+    switch (*c->p) {
+    case '{':
+    case '[':
+      depth++;
+      c->p++;
+      break;
+    case '}':
+    case ']':
+      if (depth == 0)
+        return false;
+      depth--;
+      c->p++;
+      break;
+    case ',':
+    case ':':
+      if (depth == 0)
+        return false;
+      c->p++;
+      break;
+    case '"':
+      if (!skip_string(c))
+        return false;
+      break;
+    case 't':
+      if (!skip_literal(c, "true"))
+        return false;
+      break;
+    case 'f':
+      if (!skip_literal(c, "false"))
+        return false;
+      break;
+    case 'n':
+      if (!skip_literal(c, "null"))
+        return false;
+      break;
+    default:
+      if (!json_read_number(c, &num))
+        return false;
+      break;
+    }
+  } while (depth > 0);
+  return true;
+}
@@ -0,0 +1,51 @@
+#ifndef JSON_SCAN_H
+#define JSON_SCAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Pull scanner over a JSON text held in memory. Nothing is allocated and
+ * nothing is built: the caller walks objects and arrays, reads the values
+ * it wants and skips the rest. Every function returns false on malformed
+ * input, after which the cursor should be abandoned.
+ */
+typedef struct {
+  const char *p;
+  const char *end;
+  // Set until the first member of the innermost open object or array.
+  bool first;
+} json_cursor;
+
+typedef enum {
+  JSON_INVALID,
+  JSON_NULL,
+  JSON_FALSE,
+  JSON_TRUE,
+  JSON_NUMBER,
+  JSON_STRING,
+  JSON_ARRAY,
+  JSON_OBJECT,
+} json_type;
+
+void json_init(json_cursor *c, const char *text, size_t len);
+// Type of the value at the cursor, without consuming it.
+json_type json_peek(json_cursor *c);
+
+// Consumes '{' / '['.
+bool json_enter_object(json_cursor *c);
+bool json_enter_array(json_cursor *c);
+// Moves to the next member and leaves the cursor on its value; *done is set
+// instead when the closing '}' is reached. Keys are unescaped into key and
+// cut to keysz - 1 bytes.
+bool json_next_key(json_cursor *c, char *key, size_t keysz, bool *done);
+// Moves to the next element; *done is set when the closing ']' is reached.
+bool json_next_element(json_cursor *c, bool *done);
+
+// Consumes the value at the cursor whatever its type.
+bool json_skip(json_cursor *c);
+// Consumes a string, unescaped into out and cut to outsz - 1 bytes.
+bool json_read_string(json_cursor *c, char *out, size_t outsz);
+bool json_read_number(json_cursor *c, double *out);
+
+#endif /* JSON_SCAN_H */
@@ -11,9 +11,11 @@
 #include <unistd.h>
 
 #include "cJSON.h"
+#include "cache.h"
 #include "deps/sds/sds.h"
 #include "path_utils.h"
 #include "remfuse.h"
+#include "rm_parser.h"
 
 static struct options {
   const char *config_file;
@@ -102,6 +104,33 @@ static void load_config(const char *path) {
     if (cJSON_IsBool(standalone_item))
       enable_standalone_annotations = cJSON_IsTrue(standalone_item);
 
+    cJSON *threads_item = cJSON_GetObjectItem(root, "render_threads");
+    if (cJSON_IsNumber(threads_item))
+      render_threads = threads_item->valueint;
+
+    cJSON *cache_bytes_item = cJSON_GetObjectItem(root, "cache_max_bytes");
+    if (cJSON_IsNumber(cache_bytes_item) && cache_bytes_item->valuedouble >= 0)
+      cache_max_bytes = (size_t)cache_bytes_item->valuedouble;
+
+    cJSON *parsed_bytes_item =
+        cJSON_GetObjectItem(root, "parsed_cache_max_bytes");
+    if (cJSON_IsNumber(parsed_bytes_item) &&
+        parsed_bytes_item->valuedouble >= 0)
+      parsed_cache_max_bytes = (size_t)parsed_bytes_item->valuedouble;
+    // A quarter of it may go to pages kept to resume parsing them.
+    remfmt_resume_max_bytes = parsed_cache_max_bytes / 4;
+
+    cJSON *cache_dir_item = cJSON_GetObjectItemCaseSensitive(root, "cache_dir");
+    if (cache_dir_item && cJSON_IsString(cache_dir_item)) {
+      if (cache_dir)
+        free(cache_dir);
+      cache_dir = strdup(cache_dir_item->valuestring);
+    }
+
+    cJSON *dir_bytes_item = cJSON_GetObjectItem(root, "cache_dir_max_bytes");
+    if (cJSON_IsNumber(dir_bytes_item) && dir_bytes_item->valuedouble >= 0)
+      cache_dir_max_bytes = (size_t)dir_bytes_item->valuedouble;
+
     cJSON_Delete(root);
   }
 }
@@ -50,24 +50,26 @@ float clampf(float f, float lo, float hi) {
   return (f < lo) ? lo : ((f < hi) ? f : hi);
 }
 
-float get_seg_width(remfmt_stroke *st, remfmt_seg *sg) {
-  if (sg->width < 0.01f) {
+float get_seg_width(remfmt_stroke *st, size_t i) {
+  float seg_width = remfmt_point_width(&st->points, i);
+  if (seg_width < 0.01f) {
     return st->calc_width;
   }
   float width;
   switch (st->pen) {
   default:
-    width = sg->width;
+    width = seg_width;
   }
-  return clampf(width, 0.1, 4.0 * sg->width);
+  return clampf(width, 0.1, 4.0 * seg_width);
 }
 
-float get_seg_alpha(remfmt_stroke *st, remfmt_seg *sg) {
+float get_seg_alpha(remfmt_stroke *st, size_t i) {
   float alpha;
   switch (st->pen) {
   case TILT_PENCIL:
   case PENCIL_V2:
-    alpha = 0.45 * sg->pressure - (sg->speed / 26.0);
+    alpha = 0.45 * remfmt_point_pressure(&st->points, i) -
+            (remfmt_point_speed(&st->points, i) / 26.0);
     break;
   default:
     alpha = st->opacity;
@@ -118,12 +120,38 @@ unsigned map_v6_pen(unsigned pen_id) {
   }
 }
 
+void remfmt_page_extent(const remfmt_bbox *bbox, int version, float dev_w,
+                        float dev_h, bool annotation, float *min_x,
+                        float *min_y, int *port_w, int *port_h) {
+  *min_x = 0.0f;
+  float max_x = dev_w;
+  *min_y = 0.0f;
+  float max_y = dev_h;
+
+  if (bbox->min_x <= bbox->max_x && !annotation) {
+    float xOffset = (version == 6) ? (dev_w / 2.0f) : 0.0f;
+    if (bbox->min_x + xOffset < *min_x)
+      *min_x = bbox->min_x + xOffset;
+    if (bbox->max_x + xOffset > max_x)
+      max_x = bbox->max_x + xOffset;
+    if (bbox->min_y < *min_y)
+      *min_y = bbox->min_y;
+    if (bbox->max_y > max_y)
+      max_y = bbox->max_y;
+  }
+
+  *port_w = (int)ceilf(max_x - *min_x);
+  *port_h = (int)ceilf(max_y - *min_y);
+}
+
 void remfmt_render_rm(FILE *stream, remfmt_stroke_vec *strokes) {
   char buf[64] = {0};
   snprintf(buf, 44, rmv_magic, 5);
   fwrite(buf, 1, 43, stream);
 
-  int num_layers = kv_A(*strokes, strokes->n - 1).layer + 1;
+  // A page without strokes still gets a layer, as remfmt_parse wants one.
+  int num_layers =
+      strokes->n > 0 ? kv_A(*strokes, strokes->n - 1).layer + 1 : 1;
   struct_pack(buf, "<I", num_layers);
   fwrite(buf, 4, 1, stream);
   for (int l = 0; l < num_layers; l++) {
@@ -133,14 +161,15 @@ void remfmt_render_rm(FILE *stream, remfmt_stroke_vec *strokes) {
 
     for (int i = 0; i < num_strokes; i++) {
       remfmt_stroke *st = &kv_A(*strokes, i);
-      int num_segments = kv_size(st->segments);
+      const remfmt_points *p = &st->points;
+      int num_segments = p->n;
       struct_pack(buf, "<IIfffI", st->pen, st->color, st->unk1, st->width,
                   st->unk2, num_segments);
       fwrite(buf, 4, 6, stream);
       for (int j = 0; j < num_segments; j++) {
-        remfmt_seg *sg = &kv_A(st->segments, j);
-        struct_pack(buf, "<ffffff", sg->x, sg->y, sg->speed, sg->tilt,
-                    sg->width, sg->pressure);
+        struct_pack(buf, "<ffffff", p->x[j], p->y[j], remfmt_point_speed(p, j),
+                    remfmt_point_tilt(p, j), remfmt_point_width(p, j),
+                    remfmt_point_pressure(p, j));
         fwrite(buf, 4, 6, stream);
       }
     }
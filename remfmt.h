@@ -53,13 +53,14 @@ typedef enum {
 typedef struct {
   bool landscape;
   bool annotation;
-  char *template_name;
+  const char *template_name;
   char *template_dir;
   float canvas_width;
   float canvas_height;
   char *asset_dir;
 } remfmt_render_params;
 
+// One point with all its attributes, as the parser reads it.
 typedef struct {
   float x;
   float y;
@@ -69,6 +70,48 @@ typedef struct {
   float pressure;
 } remfmt_seg;
 
+// A point's attributes, packed as v6 stores them: speed as it is, width in
+// quarters, direction in 255ths of a turn and pressure in 255ths. Read them
+// through the remfmt_point_* accessors.
+typedef struct {
+  uint16_t speed;
+  uint16_t width;
+  uint8_t tilt;
+  uint8_t pressure;
+} remfmt_attr;
+
+// A run of points: an array each of x and y, and one of packed attributes.
+typedef struct {
+  float *x;
+  float *y;
+  remfmt_attr *attr;
+  size_t n;
+} remfmt_points;
+
+static inline float remfmt_point_speed(const remfmt_points *p, size_t i) {
+  return (float)p->attr[i].speed;
+}
+
+static inline float remfmt_point_tilt(const remfmt_points *p, size_t i) {
+  return (float)p->attr[i].tilt * (3.1415926535f * 2.0f) / 255.0f;
+}
+
+static inline float remfmt_point_width(const remfmt_points *p, size_t i) {
+  return (float)p->attr[i].width / 4.0f;
+}
+
+static inline float remfmt_point_pressure(const remfmt_points *p, size_t i) {
+  return (float)p->attr[i].pressure / 255.0f;
+}
+
+// In file coordinates; min > max when empty.
+typedef struct {
+  float min_x;
+  float min_y;
+  float max_x;
+  float max_y;
+} remfmt_bbox;
+
 typedef struct {
   float height;
   float width;
@@ -76,7 +119,6 @@ typedef struct {
   float y;
 } remfmt_hilite;
 
-typedef kvec_t(remfmt_seg) remfmt_seg_vec;
 typedef kvec_t(remfmt_hilite) remfmt_hilite_vec;
 
 typedef struct {
@@ -91,7 +133,9 @@ typedef struct {
   float opacity;
   bool square_cap;
 
-  remfmt_seg_vec segments;
+  // A view into the page's point arrays.
+  remfmt_points points;
+  remfmt_bbox bbox;
   int version;
 
   bool has_custom_color;
@@ -99,7 +143,27 @@ typedef struct {
   char *image_path;
 } remfmt_stroke;
 
-typedef kvec_t(remfmt_stroke) remfmt_stroke_vec;
+// The strokes of a page. Laid out like a kvec, so kv_size and kv_A apply,
+// but it holds the points of all its strokes back to back as well.
+typedef struct {
+  size_t n, m;
+  remfmt_stroke *a;
+  remfmt_points points;
+  remfmt_bbox bbox;
+  int version;
+} remfmt_stroke_vec;
+
+// Summary of a page, from remfmt_probe or remfmt_summarize.
+typedef struct {
+  int version;
+  size_t num_strokes;
+  // REMFMT_PEN_BIT of every pen in use, as remfmt_stroke.pen holds it.
+  uint32_t pens;
+  remfmt_bbox bbox;
+} remfmt_info;
+
+// Pens from 31 up, PEN_IMAGE among them, share the top bit.
+#define REMFMT_PEN_BIT(pen) ((pen) < 31 ? 1u << (pen) : 1u << 31)
 
 // Common helpers and shared variables
 extern uint32_t svg_color[];
@@ -107,8 +171,14 @@ extern const char rmv_magic[];
 
 void set_pen_attr(remfmt_stroke *st);
 float clampf(float f, float lo, float hi);
-float get_seg_width(remfmt_stroke *st, remfmt_seg *sg);
-float get_seg_alpha(remfmt_stroke *st, remfmt_seg *sg);
+float get_seg_width(remfmt_stroke *st, size_t i);
+float get_seg_alpha(remfmt_stroke *st, size_t i);
+// The area a page is drawn on: dev_w by dev_h, widened to take in all of
+// bbox unless only annotations are drawn. v6 points are shifted right by
+// half of dev_w, as their x is centred on the page.
+void remfmt_page_extent(const remfmt_bbox *bbox, int version, float dev_w,
+                        float dev_h, bool annotation, float *min_x,
+                        float *min_y, int *port_w, int *port_h);
 unsigned map_v6_pen(unsigned pen_id);
 unsigned char *load_png_template(const char *filename, int *w, int *h);
 
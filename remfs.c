@@ -1,153 +1,284 @@
+#include <fcntl.h>
 #include <glob.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#include "cJSON.h"
+#include "cache.h"
+#include "digest.h"
+#include "json_scan.h"
 #include "remfs.h"
+#include "strpool.h"
 #include "struct.h"
 
-static int uuid_map_node_fwd_cmp(const uuid_map_node *a,
-                                 const uuid_map_node *b) {
-  return strcmp(a->file->uuid, b->file->uuid);
+static uint32_t name_hash(const char *name, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)name[i]) * 16777619u;
+  return h;
 }
 
-static int uuid_map_node_rev_cmp(const uuid_map_node *a,
-                                 const uuid_map_node *b) {
-  return strcmp(a->path, b->path);
+// Returns the slot holding the entry called name, or the empty slot where
+// it would go; NULL if the directory has no entries at all.
+static uuid_map_node **name_slot(const child_table *t, const char *name,
+                                 size_t len) {
+  if (!t->slots)
+    return NULL;
+  size_t i = name_hash(name, len) & t->mask;
+  for (; t->slots[i]; i = (i + 1) & t->mask) {
+    const char *other = t->slots[i]->file->visible_name;
+    if (strncmp(other, name, len) == 0 && other[len] == '\0')
+      break;
+  }
+  return &t->slots[i];
 }
 
-RB_GENERATE(uuid_fwd_map, uuid_map_node, fwdp, uuid_map_node_fwd_cmp);
-RB_GENERATE(uuid_rev_map, uuid_map_node, revp, uuid_map_node_rev_cmp);
+static child_table *dir_names(remfs_ctx *ctx, uuid_map_node *dir) {
+  return dir ? &dir->names : &ctx->root_names;
+}
 
 uuid_map_node *remfs_path_search(remfs_ctx *ctx, const char *path) {
-  uuid_map_node q = {.path = (char *)path};
-  return RB_FIND(uuid_rev_map, ctx->rev_map, &q);
+  if (path[0] != '/')
+    return NULL;
+  uuid_map_node *dir = NULL;
+  for (const char *p = path + 1;;) {
+    const char *slash = strchr(p, '/');
+    size_t len = slash ? (size_t)(slash - p) : strlen(p);
+    uuid_map_node **slot = name_slot(dir_names(ctx, dir), p, len);
+    if (!slot || !*slot || !slash)
+      return slot ? *slot : NULL;
+    dir = *slot;
+    p = slash + 1;
+  }
 }
 
-uuid_map_node *remfs_uuid_search(remfs_ctx *ctx, const char *uuid) {
-  remfs_file file = {0};
-  uuid_map_node q = {.file = &file};
-  sprintf(file.uuid, "%s", uuid);
-  return RB_FIND(uuid_fwd_map, ctx->fwd_map, &q);
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// Packs a canonical uuid into *id and returns false; anything else is
+// digested instead and true returned.
+static bool parse_uuid(const char *uuid, remfs_uuid *id) {
+  uint64_t half[2] = {0, 0};
+  bool canonical = strlen(uuid) == 36;
+  for (int i = 0, n = 0; canonical && i < 36; i++) {
+    if (i == 8 || i == 13 || i == 18 || i == 23) {
+      canonical = uuid[i] == '-';
+      continue;
+    }
+    int d = hex_digit(uuid[i]);
+    canonical = d >= 0;
+    half[n / 16] = half[n / 16] << 4 | (uint64_t)d;
+    n++;
+  }
+  if (canonical) {
+    *id = (remfs_uuid){half[0], half[1]};
+    return false;
+  }
+  *id = (remfs_uuid){digest_bytes(uuid, strlen(uuid)), 0};
+  return true;
 }
 
-static void empty_maps(remfs_ctx *ctx) {
-  uuid_map_node *n, *nxt;
-  for (n = RB_MIN(uuid_fwd_map, ctx->fwd_map); n != NULL; n = nxt) {
-    nxt = RB_NEXT(uuid_fwd_map, ctx->fwd_map, n);
-    RB_REMOVE(uuid_fwd_map, ctx->fwd_map, n);
-    kv_destroy(n->children);
-    sdsfree(n->path);
-    free(n);
+static size_t uuid_slot(const remfs_uuid *id, size_t mask) {
+  return (id->hi ^ id->lo) * 0x9E3779B97F4A7C15ULL >> 32 & mask;
+}
+
+// Returns the slot of the uuid table holding the given uuid, or the empty
+// slot where it would go. Canonical ids compare as two integers; only
+// digested ones fall back to comparing text.
+static size_t probe(remfs_ctx *ctx, const remfs_uuid *id, bool hashed,
+                    const char *uuid) {
+  size_t i = uuid_slot(id, ctx->uuid_mask);
+  for (; ctx->uuid_table[i]; i = (i + 1) & ctx->uuid_mask) {
+    const remfs_file *f = ctx->uuid_table[i]->file;
+    if (f->id.hi == id->hi && f->id.lo == id->lo && f->id_hashed == hashed &&
+        (!hashed || strcmp(f->uuid, uuid) == 0))
+      break;
   }
+  return i;
+}
+
+static uuid_map_node *find_node(remfs_ctx *ctx, const remfs_uuid *id,
+                                bool hashed, const char *uuid) {
+  if (!ctx->uuid_table)
+    return NULL;
+  return ctx->uuid_table[probe(ctx, id, hashed, uuid)];
+}
+
+uuid_map_node *remfs_uuid_search(remfs_ctx *ctx, const char *uuid) {
+  remfs_uuid id;
+  bool hashed = parse_uuid(uuid, &id);
+  return find_node(ctx, &id, hashed, uuid);
 }
 
 void remfs_destroy(remfs_ctx *ctx) {
   if (ctx) {
-    empty_maps(ctx);
-    free(ctx->fwd_map);
-    free(ctx->rev_map);
+    for (size_t i = 0; i < ctx->num_nodes; i++) {
+      kv_destroy(ctx->nodes[i].children);
+      free(ctx->nodes[i].names.slots);
+    }
+    free(ctx->nodes);
+    free(ctx->uuid_table);
     kv_destroy(ctx->fv);
+    kv_destroy(ctx->sources);
     kv_destroy(ctx->root_children);
+    free(ctx->root_names.slots);
+    strpool_unref(ctx->strings);
     free(ctx->src_dir);
     free(ctx);
   }
 }
 
-static char *gen_path(remfs_ctx *ctx, size_t idx) {
-  remfs_file *file = &kv_A(ctx->fv, idx);
-  kvec_t(char *) stk = {0, 0, 0};
-  sds fp = sdsempty();
-
-  if (file->parent[0] == '\0') {
-    fp = sdscatprintf(fp, "/%s", file->visible_name);
-  } else {
-    kv_push(char *, stk, file->visible_name);
-    uuid_map_node *ref = remfs_uuid_search(ctx, file->parent);
-    int depth = 0;
-    while (ref != NULL && depth < 64) {
-      kv_push(char *, stk, ref->file->visible_name);
-      ref = remfs_uuid_search(ctx, ref->file->parent);
-      depth++;
+// A chain of parents that loops back on itself would leave its members
+// unreachable from the root. Each loop is cut at its earliest record, which
+// is listed at the root instead. Each node is walked through once.
+static void break_cycles(remfs_ctx *ctx) {
+  enum { UNSEEN, ON_WALK, DONE };
+  uint8_t *state = calloc(ctx->num_nodes ? ctx->num_nodes : 1, 1);
+  for (size_t i = 0; i < ctx->num_nodes; i++) {
+    uuid_map_node *s = &ctx->nodes[i];
+    while (s && state[s - ctx->nodes] == UNSEEN) {
+      state[s - ctx->nodes] = ON_WALK;
+      s = s->dir;
+    }
+    // The walk ran into itself: s is on a loop.
+    uuid_map_node *first = NULL;
+    if (s && state[s - ctx->nodes] == ON_WALK) {
+      first = s;
+      for (uuid_map_node *t = s->dir; t != s; t = t->dir) {
+        if (t < first)
+          first = t;
+      }
     }
-    while (kv_size(stk) > 0)
-      fp = sdscatprintf(fp, "/%s", kv_pop(stk));
+    for (s = &ctx->nodes[i]; s && state[s - ctx->nodes] == ON_WALK; s = s->dir)
+      state[s - ctx->nodes] = DONE;
+    if (first)
+      first->dir = NULL;
   }
-  kv_destroy(stk);
-  return fp;
+  free(state);
 }
 
-static void add_member(remfs_ctx *ctx, uuid_map_node *s) {
-  if (s->file->parent[0] == '\0') {
-    kv_push(uuid_map_node *, ctx->root_children, s);
-  } else {
-    uuid_map_node *ref = remfs_uuid_search(ctx, s->file->parent);
-    if (!ref) {
-      kv_push(uuid_map_node *, ctx->root_children, s);
-      return;
-    }
-    kv_push(uuid_map_node *, ref->children, s);
-  }
+static void init_names(child_table *t, size_t count) {
+  if (count == 0)
+    return;
+  size_t slots = 4;
+  while (slots < count * 2)
+    slots *= 2;
+  t->slots = calloc(slots, sizeof(uuid_map_node *));
+  t->mask = slots - 1;
 }
 
-remfs_ctx *remfs_init(const char *src_dir) {
+// Takes over strings, fv and sources.
+static remfs_ctx *build_ctx(const char *src_dir, strpool *strings,
+                            remfs_file_vec fv, remfs_source_vec sources,
+                            int64_t dir_mtime_ns) {
   remfs_ctx *ctx = calloc(1, sizeof(remfs_ctx));
   ctx->src_dir = strdup(src_dir);
-  struct stat stbuf;
-  sds tmp = sdsempty();
-
-  remfs_list(ctx->src_dir, &ctx->fv);
-  ctx->fwd_map = calloc(1, sizeof(uuid_fwd_map));
-  ctx->rev_map = calloc(1, sizeof(uuid_rev_map));
-
-  RB_INIT(ctx->fwd_map);
-  RB_INIT(ctx->rev_map);
-  for (int i = 0; i < kv_size(ctx->fv); i++) {
+  ctx->strings = strings;
+  ctx->refcount = 1;
+  ctx->fv = fv;
+  ctx->sources = sources;
+  ctx->dir_mtime_ns = dir_mtime_ns;
+  // One node per live record, all in one array, indexed by uuid in a table
+  // kept at most half full. A uuid seen twice keeps its first record.
+  size_t n = kv_size(ctx->fv), slots = 16;
+  while (slots < n * 2)
+    slots *= 2;
+  ctx->nodes = calloc(n ? n : 1, sizeof(uuid_map_node));
+  ctx->uuid_table = calloc(slots, sizeof(uuid_map_node *));
+  ctx->uuid_mask = slots - 1;
+  for (size_t i = 0; i < n; i++) {
     remfs_file *file = &kv_A(ctx->fv, i);
     if (file->deleted)
       continue;
-    sdsclear(tmp);
-    if (file->filetype == PAGE) {
-      tmp = sdscatprintf(tmp, "%s/%s/%s.rm", ctx->src_dir, file->parent,
-                         file->uuid);
-    } else {
-      tmp = sdscatprintf(tmp, "%s/%s.metadata", ctx->src_dir, file->uuid);
-    }
-    if (stat(tmp, &stbuf) == -1)
+    size_t j = probe(ctx, &file->id, file->id_hashed, file->uuid);
+    if (ctx->uuid_table[j])
       continue;
-    uuid_map_node *s = calloc(1, sizeof(uuid_map_node));
+    uuid_map_node *s = &ctx->nodes[ctx->num_nodes++];
     s->file = file;
-    if (RB_INSERT(uuid_fwd_map, ctx->fwd_map, s) != NULL) {
-      free(s);
-    }
+    ctx->uuid_table[j] = s;
   }
 
-  for (int i = 0; i < kv_size(ctx->fv); i++) {
-    remfs_file *file = &kv_A(ctx->fv, i);
-    uuid_map_node *s = remfs_uuid_search(ctx, file->uuid);
-    if (s == NULL)
+  // Every node is listed by its parent, or by the root when it has none or
+  // the parent is not indexed. Of several entries with the same name in one
+  // directory only the first is listed.
+  size_t *counts = calloc(ctx->num_nodes + 1, sizeof(size_t));
+  for (size_t i = 0; i < ctx->num_nodes; i++) {
+    uuid_map_node *s = &ctx->nodes[i];
+    if (s->file->parent[0] != '\0')
+      s->dir = remfs_uuid_search(ctx, s->file->parent);
+  }
+  break_cycles(ctx);
+  for (size_t i = 0; i < ctx->num_nodes; i++) {
+    uuid_map_node *s = &ctx->nodes[i];
+    counts[s->dir ? (size_t)(s->dir - ctx->nodes) : ctx->num_nodes]++;
+  }
+  for (size_t i = 0; i < ctx->num_nodes; i++)
+    init_names(&ctx->nodes[i].names, counts[i]);
+  init_names(&ctx->root_names, counts[ctx->num_nodes]);
+  free(counts);
+
+  for (size_t i = 0; i < ctx->num_nodes; i++) {
+    uuid_map_node *s = &ctx->nodes[i];
+    const char *name = s->file->visible_name;
+    uuid_map_node **slot =
+        name_slot(dir_names(ctx, s->dir), name, strlen(name));
+    if (!slot || *slot)
       continue;
-    if (s->path == NULL) {
-      s->path = gen_path(ctx, i);
-      if (RB_INSERT(uuid_rev_map, ctx->rev_map, s) != NULL) {
-        sdsfree(s->path);
-        s->path = NULL;
-      } else {
-        add_member(ctx, s);
-      }
-    }
+    *slot = s;
+    children_vec *list = s->dir ? &s->dir->children : &ctx->root_children;
+    kv_push(uuid_map_node *, *list, s);
   }
-  sdsfree(tmp);
   return ctx;
 }
 
+typedef struct {
+  sds path;
+  uuid_map_node *node;
+} path_entry;
+typedef kvec_t(path_entry) path_entry_vec;
+
+static int cmp_path_entry(const void *a, const void *b) {
+  return strcmp(((const path_entry *)a)->path, ((const path_entry *)b)->path);
+}
+
+static void push_path(path_entry_vec *entries, const char *dir_path,
+                      uuid_map_node *s) {
+  path_entry e = {sdscatprintf(sdsempty(), "%s/%s", dir_path,
+                               s->file->visible_name),
+                  s};
+  kv_push(path_entry, *entries, e);
+}
+
+// Lists every path with its uuid, in path order. The entries double as the
+// queue of a breadth-first walk, so each path is built once, from its
+// directory's.
 void remfs_print(remfs_ctx *ctx, FILE *stream) {
-  uuid_map_node *n;
-  RB_FOREACH(n, uuid_rev_map, ctx->rev_map)
-  fprintf(stream, "%s->%s\n", n->path, n->file->uuid);
+  path_entry_vec entries;
+  kv_init(entries);
+  for (size_t i = 0; i < kv_size(ctx->root_children); i++)
+    push_path(&entries, "", kv_A(ctx->root_children, i));
+  for (size_t i = 0; i < kv_size(entries); i++) {
+    uuid_map_node *dir = kv_A(entries, i).node;
+    for (size_t k = 0; k < kv_size(dir->children); k++)
+      push_path(&entries, kv_A(entries, i).path, kv_A(dir->children, k));
+  }
+  qsort(entries.a, kv_size(entries), sizeof(path_entry), cmp_path_entry);
+  for (size_t i = 0; i < kv_size(entries); i++) {
+    path_entry *e = &kv_A(entries, i);
+    fprintf(stream, "%s->%s\n", e->path, e->node->file->uuid);
+    sdsfree(e->path);
+  }
+  kv_destroy(entries);
   fflush(stream);
 }
 
@@ -172,14 +303,69 @@ cleanup:
   return ret;
 }
 
-static void parse_meta(const char *path, remfs_file *file) {
-  cJSON *json, *p;
-  char *str;
+// cJSON's valueint: the number truncated and saturated to int.
+static int to_int(double d) {
+  if (d >= INT_MAX)
+    return INT_MAX;
+  if (d <= (double)INT_MIN)
+    return INT_MIN;
+  return (int)d;
+}
+
+// Sets file->uuid and its binary form.
+static void set_uuid(strpool *strings, remfs_file *file, const char *uuid) {
+  file->uuid = strpool_intern_cstr(strings, uuid);
+  file->id_hashed = parse_uuid(uuid, &file->id);
+}
+
+// Whether interning gave the record every string it needs; the pool hands
+// out NULL once it is out of memory.
+static bool record_complete(const remfs_file *rec) {
+  return rec->uuid && rec->parent && rec->visible_name && rec->template_name;
+}
+
+// A record with every string set to "".
+static remfs_file empty_file(void) {
+  remfs_file file = {
+      .uuid = "", .parent = "", .visible_name = "", .template_name = ""};
+  file.id_hashed = parse_uuid(file.uuid, &file.id);
+  return file;
+}
+
+static void parse_meta(const char *path, strpool *strings, remfs_file *file) {
   uint8_t *raw = slurp(path);
   if (!raw)
     return;
-  json = cJSON_Parse((const char *)raw);
-  if (!json)
+
+  char key[32], word[32];
+  char visible_name[RM_PATH_MAX] = "Untitled";
+  char parent[64] = "";
+  remfs_type type = file->type;
+  bool deleted = false;
+
+  json_cursor c;
+  json_init(&c, (const char *)raw, strlen((const char *)raw));
+  bool ok = json_enter_object(&c), done = false;
+  while (ok && (ok = json_next_key(&c, key, sizeof(key), &done)) && !done) {
+    json_type t = json_peek(&c);
+    if (strcmp(key, "visibleName") == 0 && t == JSON_STRING) {
+      ok = json_read_string(&c, visible_name, sizeof(visible_name));
+    } else if (strcmp(key, "parent") == 0 && t == JSON_STRING) {
+      ok = json_read_string(&c, parent, sizeof(parent));
+    } else if (strcmp(key, "type") == 0 && t == JSON_STRING) {
+      ok = json_read_string(&c, word, sizeof(word));
+      if (strcmp(word, "DocumentType") == 0) {
+        type = DOCUMENT;
+      } else if (strcmp(word, "CollectionType") == 0) {
+        type = COLLECTION;
+      }
+    } else {
+      if (strcmp(key, "deleted") == 0)
+        deleted = t == JSON_TRUE;
+      ok = json_skip(&c);
+    }
+  }
+  if (!ok)
     goto cleanup;
 
   const char *filename = strrchr(path, '/');
@@ -188,46 +374,25 @@ static void parse_meta(const char *path, remfs_file *file) {
   } else {
     filename = path;
   }
-  snprintf(file->uuid, sizeof(file->uuid), "%.36s", filename);
-
-  p = cJSON_GetObjectItem(json, "visibleName");
-  if (cJSON_IsString(p)) {
-    snprintf(file->visible_name, RM_PATH_MAX, "%s", cJSON_GetStringValue(p));
-    for (char *c = file->visible_name; *c; c++) {
-      if (*c == '/')
-        *c = '_';
-    }
-  } else {
-    snprintf(file->visible_name, RM_PATH_MAX, "Untitled");
-  }
+  char uuid[64];
+  snprintf(uuid, sizeof(uuid), "%.36s", filename);
+  set_uuid(strings, file, uuid);
 
-  p = cJSON_GetObjectItem(json, "parent");
-  if (cJSON_IsString(p)) {
-    snprintf(file->parent, sizeof(file->parent), "%s", cJSON_GetStringValue(p));
-  } else {
-    file->parent[0] = '\0';
-  }
-
-  p = cJSON_GetObjectItem(json, "type");
-  if (cJSON_IsString(p)) {
-    str = cJSON_GetStringValue(p);
-    if (strcmp(str, "DocumentType") == 0) {
-      file->type = DOCUMENT;
-    } else if (strcmp(str, "CollectionType") == 0) {
-      file->type = COLLECTION;
-    }
+  for (char *ch = visible_name; *ch; ch++) {
+    if (*ch == '/')
+      *ch = '_';
   }
+  file->visible_name = strpool_intern_cstr(strings, visible_name);
+  file->parent = strpool_intern_cstr(strings, parent);
+  file->type = type;
+  file->deleted = deleted;
 
-  p = cJSON_GetObjectItem(json, "deleted");
-  file->deleted = cJSON_IsTrue(p) ? true : false;
-
-  cJSON_Delete(json);
 cleanup:
   free(raw);
 }
 
-static void parse_pagedata(const char *path, remfs_file *file,
-                           remfs_file_vec *fv) {
+static void parse_pagedata(const char *path, strpool *strings,
+                           remfs_file *file, remfs_file_vec *fv) {
   FILE *in = fopen(path, "r");
   if (!in)
     return;
@@ -253,7 +418,7 @@ static void parse_pagedata(const char *path, remfs_file *file,
           break;
         }
         remfs_file *p = &kv_A(*fv, pg);
-        snprintf(p->template_name, sizeof(p->template_name), "%s", line);
+        p->template_name = strpool_intern(strings, line, len);
         pg++;
       }
     }
@@ -261,208 +426,836 @@ static void parse_pagedata(const char *path, remfs_file *file,
   fclose(in);
 }
 
-static void parse_content(const char *path, remfs_file *file,
-                          remfs_file_vec *fv) {
-  cJSON *json, *p;
-  char *str;
+// A page's template is either a plain string or a CRDT register
+// {"timestamp": ..., "value": "..."}.
+static bool parse_template(json_cursor *c, char *name, size_t namesz) {
+  json_type t = json_peek(c);
+  if (t == JSON_STRING)
+    return json_read_string(c, name, namesz);
+  if (t != JSON_OBJECT)
+    return json_skip(c);
+
+  char key[32];
+  bool ok = json_enter_object(c), done = false;
+  while (ok && (ok = json_next_key(c, key, sizeof(key), &done)) && !done) {
+    if (strcmp(key, "value") == 0 && json_peek(c) == JSON_STRING)
+      ok = json_read_string(c, name, namesz);
+    else
+      ok = json_skip(c);
+  }
+  return ok;
+}
+
+// Appends a record for each page in a "pages" array. Entries are either the
+// page id or an object carrying it in "id" (v6 .content, where everything
+// else about the page is skipped).
+static bool parse_pages(json_cursor *c, strpool *strings,
+                        const remfs_file *doc, remfs_file_vec *fv,
+                        unsigned *pn) {
+  char key[32], uuid[64], template_name[RM_PATH_MAX], name[32];
+  bool ok = json_enter_array(c), done = false;
+  while (ok && (ok = json_next_element(c, &done)) && !done) {
+    bool has_id = false;
+    template_name[0] = '\0';
+    json_type t = json_peek(c);
+    if (t == JSON_STRING) {
+      ok = has_id = json_read_string(c, uuid, sizeof(uuid));
+    } else if (t == JSON_OBJECT) {
+      bool end = false;
+      ok = json_enter_object(c);
+      while (ok && (ok = json_next_key(c, key, sizeof(key), &end)) && !end) {
+        if (strcmp(key, "id") == 0 && json_peek(c) == JSON_STRING)
+          ok = has_id = json_read_string(c, uuid, sizeof(uuid));
+        else if (strcmp(key, "template") == 0)
+          ok = parse_template(c, template_name, sizeof(template_name));
+        else
+          ok = json_skip(c);
+      }
+    } else {
+      ok = json_skip(c);
+    }
+    if (ok && has_id) {
+      remfs_file page = empty_file();
+      page.type = DOCUMENT;
+      page.filetype = PAGE;
+      page.page_count = 1;
+      set_uuid(strings, &page, uuid);
+      page.parent = doc->uuid;
+      snprintf(name, sizeof(name), "page_%06u", 1 + (*pn)++);
+      page.visible_name = strpool_intern_cstr(strings, name);
+      page.template_name = strpool_intern_cstr(strings, template_name);
+      kv_push(remfs_file, *fv, page);
+    }
+  }
+  return ok;
+}
+
+/*
+ * Pulls the handful of fields remfs uses out of a .content file in one pass,
+ * without building a tree: on large PDFs most of the file is page and redo
+ * history that is only skipped over. The document record is pushed first,
+ * followed by its pages. A top-level "pages" array takes precedence over
+ * cPages.pages; fields pages inherit from the document are filled in once
+ * the whole file has been read, since they may follow the page list.
+ */
+static void parse_content(const char *path, strpool *strings,
+                          remfs_file *file, remfs_file_vec *fv) {
   uint8_t *raw = slurp(path);
   if (!raw)
     return;
-  json = cJSON_Parse((const char *)raw);
-  if (!json)
-    goto cleanup;
 
-  p = cJSON_GetObjectItem(json, "fileType");
-  if (cJSON_IsString(p)) {
-    str = cJSON_GetStringValue(p);
-    if (strcmp(str, "notebook") == 0) {
-      file->filetype = NOTEBOOK;
-    } else if (strcmp(str, "epub") == 0) {
-      file->filetype = EPUB;
-    } else if (strcmp(str, "pdf") == 0) {
-      file->filetype = PDF;
+  char key[32], word[32];
+  remfs_file doc = *file;
+  doc.dummy = false;
+  doc.margins = 0;
+  doc.custom_zoom_scale = 0.0;
+  doc.custom_zoom_page_height = 0;
+  doc.custom_zoom_page_width = 0;
+  size_t doc_idx = kv_size(*fv);
+  kv_push(remfs_file, *fv, doc);
+  unsigned pn = 0;
+  bool top_pages = false;
+
+  json_cursor c;
+  json_init(&c, (const char *)raw, strlen((const char *)raw));
+  bool ok = json_enter_object(&c), done = false;
+  while (ok && (ok = json_next_key(&c, key, sizeof(key), &done)) && !done) {
+    json_type t = json_peek(&c);
+    double num;
+    if (strcmp(key, "fileType") == 0 && t == JSON_STRING) {
+      ok = json_read_string(&c, word, sizeof(word));
+      if (strcmp(word, "notebook") == 0) {
+        doc.filetype = NOTEBOOK;
+      } else if (strcmp(word, "epub") == 0) {
+        doc.filetype = EPUB;
+      } else if (strcmp(word, "pdf") == 0) {
+        doc.filetype = PDF;
+      }
+    } else if (strcmp(key, "orientation") == 0 && t == JSON_STRING) {
+      ok = json_read_string(&c, word, sizeof(word));
+      doc.landscape = strcmp(word, "landscape") == 0;
+    } else if (strcmp(key, "margins") == 0 && t == JSON_NUMBER) {
+      ok = json_read_number(&c, &num);
+      doc.margins = to_int(num);
+    } else if (strcmp(key, "customZoomScale") == 0 && t == JSON_NUMBER) {
+      ok = json_read_number(&c, &doc.custom_zoom_scale);
+    } else if (strcmp(key, "customZoomPageHeight") == 0 &&
+               t == JSON_NUMBER) {
+      ok = json_read_number(&c, &num);
+      doc.custom_zoom_page_height = to_int(num);
+    } else if (strcmp(key, "customZoomPageWidth") == 0 && t == JSON_NUMBER) {
+      ok = json_read_number(&c, &num);
+      doc.custom_zoom_page_width = to_int(num);
+    } else if (strcmp(key, "pages") == 0) {
+      top_pages = true;
+      kv_size(*fv) = doc_idx + 1;
+      pn = 0;
+      ok = t == JSON_ARRAY ? parse_pages(&c, strings, &doc, fv, &pn)
+                           : json_skip(&c);
+    } else if (strcmp(key, "cPages") == 0 && t == JSON_OBJECT && !top_pages) {
+      bool end = false;
+      ok = json_enter_object(&c);
+      while (ok && (ok = json_next_key(&c, key, sizeof(key), &end)) && !end) {
+        if (strcmp(key, "pages") == 0 && json_peek(&c) == JSON_ARRAY)
+          ok = parse_pages(&c, strings, &doc, fv, &pn);
+        else
+          ok = json_skip(&c);
+      }
+    } else {
+      if (strcmp(key, "dummyDocument") == 0)
+        doc.dummy = t == JSON_TRUE;
+      ok = json_skip(&c);
     }
   }
-
-  p = cJSON_GetObjectItem(json, "dummyDocument");
-  file->dummy = cJSON_IsTrue(p) ? true : false;
-
-  p = cJSON_GetObjectItem(json, "orientation");
-  if (cJSON_IsString(p)) {
-    str = cJSON_GetStringValue(p);
-    file->landscape = (strcmp(str, "landscape") == 0);
+  if (!ok) {
+    kv_size(*fv) = doc_idx;
+    goto cleanup;
   }
 
-  p = cJSON_GetObjectItem(json, "margins");
-  if (cJSON_IsNumber(p)) {
-    file->margins = p->valueint;
-  } else {
-    file->margins = 0;
+  for (size_t i = doc_idx + 1; i < kv_size(*fv); i++) {
+    remfs_file *page = &kv_A(*fv, i);
+    page->deleted = doc.deleted;
+    page->dummy = doc.dummy;
+    page->landscape = doc.landscape;
   }
+  doc.page_count = pn;
+  kv_A(*fv, doc_idx) = doc;
+  *file = doc;
 
-  p = cJSON_GetObjectItem(json, "customZoomScale");
-  if (cJSON_IsNumber(p)) {
-    file->custom_zoom_scale = p->valuedouble;
-  } else {
-    file->custom_zoom_scale = 0.0;
-  }
+cleanup:
+  free(raw);
+}
 
-  p = cJSON_GetObjectItem(json, "customZoomPageHeight");
-  if (cJSON_IsNumber(p)) {
-    file->custom_zoom_page_height = p->valueint;
-  } else {
-    file->custom_zoom_page_height = 0;
-  }
+static int64_t mtime_ns(const struct stat *st) {
+  return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
 
-  p = cJSON_GetObjectItem(json, "customZoomPageWidth");
-  if (cJSON_IsNumber(p)) {
-    file->custom_zoom_page_width = p->valueint;
-  } else {
-    file->custom_zoom_page_width = 0;
+static void stat_source(const char *path, remfs_source *src) {
+  static const char *const exts[3] = {"metadata", "content", "pagedata"};
+  struct stat st;
+  sds p = sdsempty();
+  for (int i = 0; i < 3; i++) {
+    sdsclear(p);
+    p = sdscatprintf(p, "%s/%s.%s", path, src->uuid, exts[i]);
+    if (stat(p, &st) == 0) {
+      src->size[i] = st.st_size;
+      src->mtime_ns[i] = mtime_ns(&st);
+    } else {
+      src->size[i] = -1;
+      src->mtime_ns[i] = 0;
+    }
   }
+  sdsclear(p);
+  p = sdscatprintf(p, "%s/%s", path, src->uuid);
+  src->pages_mtime_ns = stat(p, &st) == 0 ? mtime_ns(&st) : 0;
+  sdsfree(p);
+}
 
-  size_t doc_idx = kv_size(*fv);
-  kv_push(remfs_file, *fv, *file);
+// The uuid a .metadata path is filed under, as parse_meta derives it.
+static void source_uuid(const char *meta_path, char *uuid) {
+  const char *filename = strrchr(meta_path, '/');
+  filename = filename ? filename + 1 : meta_path;
+  snprintf(uuid, 64, "%.36s", filename);
+  char *dot = strchr(uuid, '.');
+  if (dot)
+    *dot = '\0';
+}
 
-  unsigned pn = 0;
-  p = cJSON_GetObjectItem(json, "pages");
-  if (!p) {
-    cJSON *cPages = cJSON_GetObjectItem(json, "cPages");
-    if (cPages) {
-      p = cJSON_GetObjectItem(cPages, "pages");
-    }
+// Appends the record described by one .metadata file and, for documents,
+// the records of its pages. Pages whose .rm file does not exist are left
+// out. Returns false if a string could not be interned, which fails the
+// whole scan.
+static bool scan_entry(const char *path, const char *meta_path,
+                       strpool *strings, remfs_file_vec *fv,
+                       remfs_source_vec *sv) {
+  remfs_source src = {{0}};
+  source_uuid(meta_path, src.uuid);
+  stat_source(path, &src);
+  kv_push(remfs_source, *sv, src);
+
+  remfs_file file = empty_file();
+  parse_meta(meta_path, strings, &file);
+  if (!record_complete(&file))
+    return false;
+  file.mtime_ns = src.mtime_ns[0];
+  if (file.type != DOCUMENT) {
+    kv_push(remfs_file, *fv, file);
+    return true;
   }
-  if (cJSON_IsArray(p)) {
-    cJSON *n = NULL;
-    cJSON_ArrayForEach(n, p) {
-      const char *page_uuid = NULL;
-      if (cJSON_IsString(n)) {
-        page_uuid = cJSON_GetStringValue(n);
-      } else if (cJSON_IsObject(n)) {
-        cJSON *id_obj = cJSON_GetObjectItem(n, "id");
-        if (cJSON_IsString(id_obj)) {
-          page_uuid = cJSON_GetStringValue(id_obj);
-        }
-      }
-      if (page_uuid) {
-        remfs_file page = {.type = DOCUMENT,
-                           .filetype = PAGE,
-                           .page_count = 1,
-                           .deleted = file->deleted,
-                           .dummy = file->dummy,
-                           .landscape = file->landscape};
-        snprintf(page.uuid, sizeof(page.uuid), "%s", page_uuid);
-        snprintf(page.parent, sizeof(page.parent), "%s", file->uuid);
-        snprintf(page.visible_name, RM_PATH_MAX, "page_%06u", 1 + pn++);
-
-        if (cJSON_IsObject(n)) {
-          cJSON *temp_obj = cJSON_GetObjectItem(n, "template");
-          if (temp_obj) {
-            const char *tpl_val = NULL;
-            if (cJSON_IsString(temp_obj)) {
-              tpl_val = cJSON_GetStringValue(temp_obj);
-            } else if (cJSON_IsObject(temp_obj)) {
-              cJSON *val_obj = cJSON_GetObjectItem(temp_obj, "value");
-              if (cJSON_IsString(val_obj)) {
-                tpl_val = cJSON_GetStringValue(val_obj);
-              }
-            }
-            if (tpl_val) {
-              snprintf(page.template_name, sizeof(page.template_name), "%s",
-                       tpl_val);
-            }
-          }
-        }
 
-        kv_push(remfs_file, *fv, page);
-      }
+  size_t first = kv_size(*fv);
+  sds side_path = sdscatprintf(sdsempty(), "%s/%s.content", path, file.uuid);
+  parse_content(side_path, strings, &file, fv);
+  sdsclear(side_path);
+  side_path = sdscatprintf(side_path, "%s/%s.pagedata", path, file.uuid);
+  parse_pagedata(side_path, strings, &file, fv);
+
+  // The .rm files are stat'ed here once, so that nothing serving the
+  // document has to stat them again.
+  size_t keep = first;
+  int64_t latest = file.mtime_ns;
+  bool complete = true;
+  for (size_t i = first; complete && i < kv_size(*fv); i++) {
+    remfs_file *rec = &kv_A(*fv, i);
+    complete = record_complete(rec);
+    if (complete && rec->filetype == PAGE) {
+      struct stat stbuf;
+      sdsclear(side_path);
+      side_path = sdscatprintf(side_path, "%s/%s/%s.rm", path, rec->parent,
+                               rec->uuid);
+      if (stat(side_path, &stbuf) == -1)
+        continue;
+      rec->rm_size = stbuf.st_size;
+      rec->mtime_ns = mtime_ns(&stbuf);
+      if (rec->mtime_ns > latest)
+        latest = rec->mtime_ns;
     }
+    if (keep != i)
+      kv_A(*fv, keep) = *rec;
+    keep++;
+  }
+  kv_size(*fv) = keep;
+  for (size_t i = first; i < keep; i++) {
+    if (kv_A(*fv, i).filetype != PAGE)
+      kv_A(*fv, i).mtime_ns = latest;
   }
+  sdsfree(side_path);
+  return complete;
+}
 
-  kv_A(*fv, doc_idx).page_count = pn;
-  file->page_count = pn;
+// Entries are split into one contiguous run per worker and the runs are
+// appended in glob order, so the result does not depend on the thread count.
+// Small directories are not worth the thread start-up.
+#define SCAN_MAX_THREADS 16
+#define SCAN_MIN_PER_THREAD 32
 
-  cJSON_Delete(json);
-cleanup:
-  free(raw);
+typedef struct {
+  const char *path;
+  strpool *strings;
+  char **entries;
+  size_t n;
+  remfs_file_vec fv;
+  remfs_source_vec sv;
+  bool ok;
+} scan_batch;
+
+static void *scan_worker(void *arg) {
+  scan_batch *b = arg;
+  b->ok = true;
+  for (size_t i = 0; b->ok && i < b->n; i++)
+    b->ok = scan_entry(b->path, b->entries[i], b->strings, &b->fv, &b->sv);
+  return NULL;
+}
+
+static int scan_threads(size_t n) {
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t nthreads = n / SCAN_MIN_PER_THREAD;
+  if (ncpu > 0 && nthreads > (size_t)ncpu)
+    nthreads = ncpu;
+  if (nthreads > SCAN_MAX_THREADS)
+    nthreads = SCAN_MAX_THREADS;
+  return nthreads > 1 ? (int)nthreads : 1;
 }
 
-int remfs_list(const char *path, remfs_file_vec *fv) {
+static int list_entries(const char *path, strpool *strings,
+                        remfs_file_vec *fv, remfs_source_vec *sv) {
   glob_t globbuf;
   sds glob_path = sdsempty();
-  remfs_file file;
 
   glob_path = sdscatprintf(glob_path, "%s/*.metadata", path);
   globbuf.gl_offs = 0;
   glob(glob_path, GLOB_NOSORT | GLOB_DOOFFS, NULL, &globbuf);
+  sdsfree(glob_path);
 
-  for (int i = 0; i < globbuf.gl_pathc; i++) {
-    memset(&file, 0, sizeof(remfs_file));
-    parse_meta(globbuf.gl_pathv[i], &file);
-    if (file.type == DOCUMENT) {
-      sdsclear(glob_path);
-      glob_path = sdscatprintf(glob_path, "%s/%s.content", path, file.uuid);
-      parse_content(glob_path, &file, fv);
-      sdsclear(glob_path);
-      glob_path = sdscatprintf(glob_path, "%s/%s.pagedata", path, file.uuid);
-      parse_pagedata(glob_path, &file, fv);
-    } else {
-      kv_push(remfs_file, *fv, file);
-    }
+  size_t n = globbuf.gl_pathc;
+  int nthreads = scan_threads(n);
+  scan_batch batches[SCAN_MAX_THREADS];
+  pthread_t threads[SCAN_MAX_THREADS];
+  bool started[SCAN_MAX_THREADS] = {false};
+  for (int t = 0; t < nthreads; t++) {
+    size_t lo = n * t / nthreads, hi = n * (t + 1) / nthreads;
+    batches[t] = (scan_batch){.path = path,
+                              .strings = strings,
+                              .entries = globbuf.gl_pathv + lo,
+                              .n = hi - lo};
+    kv_init(batches[t].fv);
+    kv_init(batches[t].sv);
+    if (t > 0)
+      started[t] =
+          pthread_create(&threads[t], NULL, scan_worker, &batches[t]) == 0;
+  }
+  // The calling thread takes the first run, and any run a thread could
+  // not be started for.
+  for (int t = 0; t < nthreads; t++) {
+    if (!started[t])
+      scan_worker(&batches[t]);
+  }
+
+  int ret = 0;
+  for (int t = 0; t < nthreads; t++) {
+    if (started[t])
+      pthread_join(threads[t], NULL);
+    scan_batch *b = &batches[t];
+    if (!b->ok)
+      ret = -1;
+    for (size_t i = 0; i < kv_size(b->fv); i++)
+      kv_push(remfs_file, *fv, kv_A(b->fv, i));
+    for (size_t i = 0; i < kv_size(b->sv); i++)
+      kv_push(remfs_source, *sv, kv_A(b->sv, i));
+    kv_destroy(b->fv);
+    kv_destroy(b->sv);
   }
-  sdsfree(glob_path);
   globfree(&globbuf);
-  return 0;
+  return ret;
 }
 
-void remfs_reload(remfs_ctx *ctx) {
-  empty_maps(ctx);
-  kv_destroy(ctx->fv);
-  kv_destroy(ctx->root_children);
+int remfs_list(const char *path, strpool *strings, remfs_file_vec *fv) {
+  remfs_source_vec sv;
+  kv_init(sv);
+  int ret = list_entries(path, strings, fv, &sv);
+  kv_destroy(sv);
+  return ret;
+}
 
-  memset(&ctx->fv, 0, sizeof(ctx->fv));
-  memset(&ctx->root_children, 0, sizeof(ctx->root_children));
-  RB_INIT(ctx->fwd_map);
-  RB_INIT(ctx->rev_map);
+static int64_t dir_mtime(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? mtime_ns(&st) : 0;
+}
 
-  sds tmp = sdsempty();
-  struct stat stbuf;
-  remfs_list(ctx->src_dir, &ctx->fv);
+remfs_ctx *remfs_init(const char *src_dir) {
+  remfs_file_vec fv;
+  remfs_source_vec sv;
+  kv_init(fv);
+  kv_init(sv);
+  strpool *strings = strpool_new();
+  int64_t dir_mtime_ns = dir_mtime(src_dir);
+  if (list_entries(src_dir, strings, &fv, &sv) != 0) {
+    kv_destroy(fv);
+    kv_destroy(sv);
+    strpool_unref(strings);
+    return NULL;
+  }
+  return build_ctx(src_dir, strings, fv, sv, dir_mtime_ns);
+}
 
-  for (int i = 0; i < kv_size(ctx->fv); i++) {
-    remfs_file *file = &kv_A(ctx->fv, i);
-    if (file->deleted)
+static int cmp_uuid_ptr(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Builds a generation from the records and sources of an earlier one,
+// rescanning the entries named in uuids. The records' strings must live in
+// strings, a reference to which passes to the new generation.
+static remfs_ctx *update_records(const char *src_dir, strpool *strings,
+                                 const remfs_file *recs, size_t nrecs,
+                                 const remfs_source *srcs, size_t nsrcs,
+                                 int64_t dir_mtime_ns, const char **uuids,
+                                 size_t n) {
+  const char **dirty = malloc((n ? n : 1) * sizeof(char *));
+  memcpy(dirty, uuids, n * sizeof(char *));
+  qsort(dirty, n, sizeof(char *), cmp_uuid_ptr);
+
+  remfs_file_vec fv;
+  kv_init(fv);
+  kv_resize(remfs_file, fv, nrecs);
+  for (size_t i = 0; i < nrecs; i++) {
+    const remfs_file *file = &recs[i];
+    const char *owner = file->filetype == PAGE ? file->parent : file->uuid;
+    if (bsearch(&owner, dirty, n, sizeof(char *), cmp_uuid_ptr))
       continue;
-    sdsclear(tmp);
-    if (file->filetype == PAGE) {
-      tmp = sdscatprintf(tmp, "%s/%s/%s.rm", ctx->src_dir, file->parent,
-                         file->uuid);
-    } else {
-      tmp = sdscatprintf(tmp, "%s/%s.metadata", ctx->src_dir, file->uuid);
+    kv_push(remfs_file, fv, *file);
+    remfs_file *copy = &kv_A(fv, kv_size(fv) - 1);
+    copy->strokes = __atomic_load_n(&file->strokes, __ATOMIC_RELAXED);
+    for (int k = 0; k < 2; k++) {
+      copy->png_size[k] =
+          __atomic_load_n(&file->png_size[k], __ATOMIC_RELAXED);
+      copy->pages_version[k] =
+          __atomic_load_n(&file->pages_version[k], __ATOMIC_RELAXED);
     }
-    if (stat(tmp, &stbuf) == -1)
+  }
+  remfs_source_vec sv;
+  kv_init(sv);
+  kv_resize(remfs_source, sv, nsrcs);
+  for (size_t i = 0; i < nsrcs; i++) {
+    const char *owner = srcs[i].uuid;
+    if (!bsearch(&owner, dirty, n, sizeof(char *), cmp_uuid_ptr))
+      kv_push(remfs_source, sv, srcs[i]);
+  }
+
+  sds meta_path = sdsempty();
+  bool ok = true;
+  for (size_t i = 0; ok && i < n; i++) {
+    if (i > 0 && strcmp(dirty[i], dirty[i - 1]) == 0)
       continue;
-    uuid_map_node *s = calloc(1, sizeof(uuid_map_node));
-    s->file = file;
-    if (RB_INSERT(uuid_fwd_map, ctx->fwd_map, s) != NULL) {
-      free(s);
+    sdsclear(meta_path);
+    meta_path = sdscatprintf(meta_path, "%s/%s.metadata", src_dir, dirty[i]);
+    if (access(meta_path, F_OK) == 0)
+      ok = scan_entry(src_dir, meta_path, strings, &fv, &sv);
+  }
+  sdsfree(meta_path);
+  free(dirty);
+
+  if (!ok) {
+    kv_destroy(fv);
+    kv_destroy(sv);
+    strpool_unref(strings);
+    return NULL;
+  }
+  return build_ctx(src_dir, strings, fv, sv, dir_mtime_ns);
+}
+
+remfs_ctx *remfs_update(remfs_ctx *prev, const char **uuids, size_t n) {
+  return update_records(prev->src_dir, strpool_ref(prev->strings), prev->fv.a,
+                        kv_size(prev->fv), prev->sources.a,
+                        kv_size(prev->sources), prev->dir_mtime_ns, uuids, n);
+}
+
+/*
+ * On-disk snapshot: a fixed header, the records, the remfs_source entries
+ * and then every string the records use, each stored once and NUL
+ * terminated; records refer to strings by offset. Written with the same
+ * struct layout it is read with; the header's sizes reject snapshots from
+ * builds where that layout differs.
+ */
+#define SNAPSHOT_MAGIC 0x58494d52 /* "RMIX" */
+#define SNAPSHOT_FORMAT 4
+
+typedef struct {
+  uint32_t magic;
+  uint32_t format;
+  uint32_t record_size;
+  uint32_t source_size;
+  uint64_t nrecords;
+  uint64_t nsources;
+  uint64_t strings_size;
+  int64_t dir_mtime_ns;
+} snapshot_header;
+
+// A remfs_file with its strings as offsets into the snapshot's strings.
+typedef struct {
+  uint32_t str[4];
+  remfs_uuid id;
+  uint32_t page_count;
+  int32_t margins;
+  int32_t custom_zoom_page_height;
+  int32_t custom_zoom_page_width;
+  double custom_zoom_scale;
+  int64_t rm_size;
+  int64_t mtime_ns;
+  uint8_t type;
+  uint8_t filetype;
+  uint8_t strokes;
+  bool deleted;
+  bool landscape;
+  bool dummy;
+  bool id_hashed;
+} snapshot_record;
+
+// Assigns snapshot offsets to interned strings, keyed by address. Offset 0
+// is the empty string.
+typedef struct {
+  const char **keys;
+  uint32_t *offsets;
+  size_t mask;
+  sds blob;
+} string_table;
+
+static uint32_t string_offset(string_table *t, const char *s) {
+  if (s[0] == '\0')
+    return 0;
+  size_t i = ((uintptr_t)s >> 3) * 0x9E3779B97F4A7C15ULL >> 20 & t->mask;
+  while (t->keys[i] && t->keys[i] != s)
+    i = (i + 1) & t->mask;
+  if (!t->keys[i]) {
+    t->keys[i] = s;
+    t->offsets[i] = sdslen(t->blob);
+    t->blob = sdscatlen(t->blob, s, strlen(s) + 1);
+  }
+  return t->offsets[i];
+}
+
+static sds snapshot_path(const char *src_dir) {
+  return sdscatprintf(sdsempty(), "%s/index-%016llx.bin", cache_dir,
+                      (unsigned long long)digest_bytes(src_dir,
+                                                       strlen(src_dir)));
+}
+
+static void save_snapshot(remfs_ctx *ctx) {
+  if (!cache_dir)
+    return;
+  mkdir(cache_dir, 0755);
+  sds path = snapshot_path(ctx->src_dir);
+  sds tmp = sdscatprintf(sdsempty(), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    sdsfree(tmp);
+    sdsfree(path);
+    return;
+  }
+
+  size_t n = kv_size(ctx->fv), slots = 1024;
+  while (slots < n * 8)
+    slots *= 2;
+  string_table strs = {.keys = calloc(slots, sizeof(char *)),
+                       .offsets = calloc(slots, sizeof(uint32_t)),
+                       .mask = slots - 1,
+                       .blob = sdsnewlen("", 1)};
+  snapshot_record *recs = calloc(n ? n : 1, sizeof(snapshot_record));
+  bool ok = strs.keys && strs.offsets && recs;
+  for (size_t i = 0; ok && i < n; i++) {
+    const remfs_file *file = &kv_A(ctx->fv, i);
+    recs[i] = (snapshot_record){
+        .str = {string_offset(&strs, file->uuid),
+                string_offset(&strs, file->parent),
+                string_offset(&strs, file->visible_name),
+                string_offset(&strs, file->template_name)},
+        .id = file->id,
+        .page_count = file->page_count,
+        .margins = file->margins,
+        .custom_zoom_page_height = file->custom_zoom_page_height,
+        .custom_zoom_page_width = file->custom_zoom_page_width,
+        .custom_zoom_scale = file->custom_zoom_scale,
+        .rm_size = file->rm_size,
+        .mtime_ns = file->mtime_ns,
+        .type = file->type,
+        .filetype = file->filetype,
+        .strokes = __atomic_load_n(&file->strokes, __ATOMIC_RELAXED),
+        .deleted = file->deleted,
+        .landscape = file->landscape,
+        .dummy = file->dummy,
+        .id_hashed = file->id_hashed};
+  }
+
+  snapshot_header hdr = {.magic = SNAPSHOT_MAGIC,
+                         .format = SNAPSHOT_FORMAT,
+                         .record_size = sizeof(snapshot_record),
+                         .source_size = sizeof(remfs_source),
+                         .nrecords = n,
+                         .nsources = kv_size(ctx->sources),
+                         .strings_size = sdslen(strs.blob),
+                         .dir_mtime_ns = ctx->dir_mtime_ns};
+  FILE *f = ok ? fdopen(fd, "wb") : NULL;
+  if (f) {
+    ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1;
+    if (ok && hdr.nrecords)
+      ok = fwrite(recs, sizeof(snapshot_record), hdr.nrecords, f) ==
+           hdr.nrecords;
+    if (ok && hdr.nsources)
+      ok = fwrite(ctx->sources.a, sizeof(remfs_source), hdr.nsources, f) ==
+           hdr.nsources;
+    if (ok)
+      ok = fwrite(strs.blob, 1, hdr.strings_size, f) == hdr.strings_size;
+    ok = fclose(f) == 0 && ok;
+  } else {
+    ok = false;
+    close(fd);
+  }
+  free(strs.keys);
+  free(strs.offsets);
+  sdsfree(strs.blob);
+  free(recs);
+  if (!ok || rename(tmp, path) != 0)
+    unlink(tmp);
+  sdsfree(tmp);
+  sdsfree(path);
+}
+
+// Pages count through their directory's mtime, which moves when one is
+// added, removed or replaced by a rename. A page rewritten in place leaves
+// that alone, which page_changed catches.
+static bool source_changed(const char *src_dir, const remfs_source *old) {
+  remfs_source now = {{0}};
+  memcpy(now.uuid, old->uuid, sizeof(now.uuid));
+  stat_source(src_dir, &now);
+  return memcmp(now.size, old->size, sizeof(now.size)) != 0 ||
+         memcmp(now.mtime_ns, old->mtime_ns, sizeof(now.mtime_ns)) != 0 ||
+         now.pages_mtime_ns != old->pages_mtime_ns;
+}
+
+static bool page_changed(const char *src_dir, const remfs_file *page) {
+  sds rm_path = sdscatprintf(sdsempty(), "%s/%s/%s.rm", src_dir,
+                             page->parent, page->uuid);
+  struct stat st;
+  bool changed = stat(rm_path, &st) != 0 || st.st_size != page->rm_size ||
+                 mtime_ns(&st) != page->mtime_ns;
+  sdsfree(rm_path);
+  return changed;
+}
+
+// Loads the snapshot for src_dir and brings it up to date: entries whose
+// files changed are rescanned, and if the directory itself changed, so are
+// .metadata files the snapshot does not know. *changed reports whether the
+// result differs from what is on disk.
+static remfs_ctx *load_snapshot(const char *src_dir, bool *changed) {
+  if (!cache_dir)
+    return NULL;
+  sds path = snapshot_path(src_dir);
+  int fd = open(path, O_RDONLY);
+  sdsfree(path);
+  if (fd == -1)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(snapshot_header)) {
+    close(fd);
+    return NULL;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  // Each count is bounded by the file size before the sizes are added up,
+  // so the sum cannot wrap.
+  const snapshot_header *hdr = map;
+  uint64_t file_size = st.st_size;
+  bool valid =
+      hdr->magic == SNAPSHOT_MAGIC && hdr->format == SNAPSHOT_FORMAT &&
+      hdr->record_size == sizeof(snapshot_record) &&
+      hdr->source_size == sizeof(remfs_source) && hdr->strings_size > 0 &&
+      hdr->nrecords <= file_size / sizeof(snapshot_record) &&
+      hdr->nsources <= file_size / sizeof(remfs_source) &&
+      hdr->strings_size <= file_size &&
+      file_size == sizeof(snapshot_header) +
+                       hdr->nrecords * sizeof(snapshot_record) +
+                       hdr->nsources * sizeof(remfs_source) +
+                       hdr->strings_size;
+  const snapshot_record *recs = (const snapshot_record *)(hdr + 1);
+  const remfs_source *srcs =
+      valid ? (const remfs_source *)(recs + hdr->nrecords) : NULL;
+  const char *blob = valid ? (const char *)(srcs + hdr->nsources) : NULL;
+  valid = valid && blob[hdr->strings_size - 1] == '\0';
+  for (size_t i = 0; valid && i < hdr->nsources; i++)
+    valid = memchr(srcs[i].uuid, '\0', sizeof(srcs[i].uuid)) != NULL;
+  if (!valid) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  strpool *strings = strpool_new();
+  remfs_file *files = malloc((hdr->nrecords + 1) * sizeof(remfs_file));
+  bool complete = true;
+  for (size_t i = 0; complete && i < hdr->nrecords; i++) {
+    const snapshot_record *rec = &recs[i];
+    const char *str[4];
+    for (int k = 0; k < 4; k++) {
+      str[k] = rec->str[k] < hdr->strings_size
+                   ? strpool_intern_cstr(strings, blob + rec->str[k])
+                   : "";
     }
+    files[i] = (remfs_file){
+        .uuid = str[0],
+        .parent = str[1],
+        .visible_name = str[2],
+        .template_name = str[3],
+        .id = rec->id,
+        .page_count = rec->page_count,
+        .margins = rec->margins,
+        .custom_zoom_page_height = rec->custom_zoom_page_height,
+        .custom_zoom_page_width = rec->custom_zoom_page_width,
+        .custom_zoom_scale = rec->custom_zoom_scale,
+        .rm_size = rec->rm_size,
+        .mtime_ns = rec->mtime_ns,
+        .type = rec->type,
+        .filetype = rec->filetype,
+        .strokes = rec->strokes,
+        .deleted = rec->deleted,
+        .landscape = rec->landscape,
+        .dummy = rec->dummy,
+        .id_hashed = rec->id_hashed};
+    complete = record_complete(&files[i]);
+  }
+  if (!complete) {
+    free(files);
+    strpool_unref(strings);
+    munmap(map, st.st_size);
+    return NULL;
   }
 
-  for (int i = 0; i < kv_size(ctx->fv); i++) {
-    remfs_file *file = &kv_A(ctx->fv, i);
-    uuid_map_node *s = remfs_uuid_search(ctx, file->uuid);
-    if (s == NULL)
-      continue;
-    if (s->path == NULL) {
-      s->path = gen_path(ctx, i);
-      if (RB_INSERT(uuid_rev_map, ctx->rev_map, s) != NULL) {
-        sdsfree(s->path);
-        s->path = NULL;
-      } else {
-        add_member(ctx, s);
+  kvec_t(const char *) dirty;
+  kv_init(dirty);
+  for (size_t i = 0; i < hdr->nsources; i++) {
+    if (source_changed(src_dir, &srcs[i]))
+      kv_push(const char *, dirty, srcs[i].uuid);
+  }
+  // Rescanning the document of a changed page drops its restored size,
+  // mtime and strokes bit along with the rest of its records.
+  for (size_t i = 0; i < hdr->nrecords; i++) {
+    if (files[i].filetype == PAGE && page_changed(src_dir, &files[i]))
+      kv_push(const char *, dirty, files[i].parent);
+  }
+
+  // Creating, deleting or renaming an entry bumps the directory's mtime;
+  // only then can there be .metadata files the snapshot has not seen.
+  int64_t dir_mtime_ns = dir_mtime(src_dir);
+  glob_t globbuf = {0};
+  kvec_t(char *) added;
+  kv_init(added);
+  if (dir_mtime_ns != hdr->dir_mtime_ns) {
+    const char **known = malloc((hdr->nsources + 1) * sizeof(char *));
+    for (size_t i = 0; i < hdr->nsources; i++)
+      known[i] = srcs[i].uuid;
+    qsort(known, hdr->nsources, sizeof(char *), cmp_uuid_ptr);
+    sds glob_path = sdscatprintf(sdsempty(), "%s/*.metadata", src_dir);
+    glob(glob_path, GLOB_NOSORT, NULL, &globbuf);
+    sdsfree(glob_path);
+    for (size_t i = 0; i < globbuf.gl_pathc; i++) {
+      char *uuid = malloc(64);
+      source_uuid(globbuf.gl_pathv[i], uuid);
+      const char *key = uuid;
+      if (bsearch(&key, known, hdr->nsources, sizeof(char *), cmp_uuid_ptr)) {
+        free(uuid);
+        continue;
       }
+      kv_push(char *, added, uuid);
+      kv_push(const char *, dirty, uuid);
     }
+    free(known);
   }
-  sdsfree(tmp);
+
+  *changed = kv_size(dirty) > 0 || dir_mtime_ns != hdr->dir_mtime_ns;
+  remfs_ctx *ctx =
+      update_records(src_dir, strings, files, hdr->nrecords, srcs,
+                     hdr->nsources, dir_mtime_ns, dirty.a, kv_size(dirty));
+  free(files);
+
+  for (size_t i = 0; i < kv_size(added); i++)
+    free(kv_A(added, i));
+  kv_destroy(added);
+  kv_destroy(dirty);
+  globfree(&globbuf);
+  munmap(map, st.st_size);
+  return ctx;
+}
+
+remfs_index *remfs_index_open(const char *src_dir) {
+  remfs_index *idx = calloc(1, sizeof(remfs_index));
+  idx->src_dir = strdup(src_dir);
+  pthread_rwlock_init(&idx->lock, NULL);
+  pthread_mutex_init(&idx->reload_lock, NULL);
+  bool changed = true;
+  idx->current = load_snapshot(idx->src_dir, &changed);
+  if (!idx->current)
+    idx->current = remfs_init(idx->src_dir);
+  if (!idx->current) {
+    pthread_rwlock_destroy(&idx->lock);
+    pthread_mutex_destroy(&idx->reload_lock);
+    free(idx->src_dir);
+    free(idx);
+    return NULL;
+  }
+  idx->current->generation = ++idx->generation;
+  if (changed)
+    save_snapshot(idx->current);
+  idx->saved_generation = idx->generation;
+  return idx;
+}
+
+void remfs_index_close(remfs_index *idx) {
+  if (idx) {
+    if (idx->generation != idx->saved_generation)
+      save_snapshot(idx->current);
+    remfs_release(idx->current);
+    pthread_rwlock_destroy(&idx->lock);
+    pthread_mutex_destroy(&idx->reload_lock);
+    free(idx->src_dir);
+    free(idx);
+  }
+}
+
+remfs_ctx *remfs_acquire(remfs_index *idx) {
+  pthread_rwlock_rdlock(&idx->lock);
+  remfs_ctx *ctx = idx->current;
+  __atomic_add_fetch(&ctx->refcount, 1, __ATOMIC_ACQUIRE);
+  pthread_rwlock_unlock(&idx->lock);
+  return ctx;
+}
+
+void remfs_release(remfs_ctx *ctx) {
+  if (ctx && __atomic_sub_fetch(&ctx->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    remfs_destroy(ctx);
+}
+
+// A scan that failed leaves the current generation in place.
+static void publish(remfs_index *idx, remfs_ctx *next) {
+  if (!next)
+    return;
+  pthread_rwlock_wrlock(&idx->lock);
+  remfs_ctx *prev = idx->current;
+  next->generation = ++idx->generation;
+  idx->current = next;
+  pthread_rwlock_unlock(&idx->lock);
+  remfs_release(prev);
+}
+
+void remfs_reload(remfs_index *idx) {
+  pthread_mutex_lock(&idx->reload_lock);
+  publish(idx, remfs_init(idx->src_dir));
+  pthread_mutex_unlock(&idx->reload_lock);
+}
+
+void remfs_refresh(remfs_index *idx, const char **uuids, size_t n) {
+  pthread_mutex_lock(&idx->reload_lock);
+  // Only holders of reload_lock replace idx->current, so it is safe to read
+  // here without taking the rwlock.
+  publish(idx, remfs_update(idx->current, uuids, n));
+  pthread_mutex_unlock(&idx->reload_lock);
 }
@@ -1,13 +1,14 @@
 #ifndef REMFS_H
 #define REMFS_H
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
 #include "deps/sds/sds.h"
-#include "tree.h"
+#include "strpool.h"
 #include <kvec.h>
 
 #define RM_PATH_MAX 256
@@ -22,55 +23,153 @@ typedef enum {
   PAGE = 4,
 } remfs_filetype;
 
+// A uuid in binary form. Ids that are not lowercase 8-4-4-4-12 hex (as in
+// hand-made test data) cannot be packed, so they are stored as a digest of
+// their text instead and flagged in remfs_file.id_hashed.
 typedef struct {
+  uint64_t hi;
+  uint64_t lo;
+} remfs_uuid;
+
+/*
+ * One index record per collection, document and page. Strings point into
+ * the owning generation's string pool (remfs_ctx.strings), so repeated
+ * values such as template names and the parent uuid of every page are
+ * stored once; they are never NULL.
+ */
+typedef struct {
+  const char *uuid;
+  const char *parent;
   // from .metadata
-  char visible_name[RM_PATH_MAX];
-  char template_name[RM_PATH_MAX];
-  char uuid[64];
-  char parent[64];
-  remfs_type type;
+  const char *visible_name;
+  // from .content/.pagedata
+  const char *template_name;
+  remfs_uuid id;
+  uint32_t page_count;
+  int32_t margins;
+  int32_t custom_zoom_page_height;
+  int32_t custom_zoom_page_width;
+  double custom_zoom_scale;
+  // Pages: size and mtime of their .rm file, as of the last scan. For
+  // documents mtime_ns is the latest of their .metadata and their pages'.
+  int64_t rm_size;
+  int64_t mtime_ns;
+  uint8_t type;
+  uint8_t filetype;
+  // Pages: whether the .rm holds any strokes, probed on first use and kept
+  // for as long as the record, which a change to rm_size or mtime_ns
+  // replaces. Read and written with __atomic builtins.
+  uint8_t strokes;
+  // Pages: the size of their PNG render plus one, without and with only the
+  // annotations drawn; 0 until probed, as a page that does not parse renders
+  // to nothing. Kept for as long as the record, which a rescan of its
+  // document replaces. Read and written with __atomic builtins.
+  uint32_t png_size[2];
+  // Documents: the digest of their pages as notebook and annotated PDFs are
+  // versioned by it, without and with the annotations; 0 until every page
+  // was known to the digest memo. Read and written with __atomic builtins.
+  uint64_t pages_version[2];
   bool deleted;
-  // from .content
-  remfs_filetype filetype;
   bool landscape;
-  size_t page_count;
   bool dummy;
-  int margins;
-  double custom_zoom_scale;
-  int custom_zoom_page_height;
-  int custom_zoom_page_width;
+  bool id_hashed;
 } remfs_file;
 
+enum { STROKES_UNKNOWN, STROKES_NONE, STROKES_PRESENT };
+
 typedef kvec_t(remfs_file) remfs_file_vec;
 
+/*
+ * What one .metadata entry was parsed from: size and mtime of its
+ * .metadata, .content and .pagedata (size -1 when missing) and the mtime of
+ * its page directory, whose entries decide which pages exist. Taken before
+ * parsing, so a file that changes mid-parse still shows up as stale.
+ */
+typedef struct {
+  char uuid[64];
+  int64_t size[3];
+  int64_t mtime_ns[3];
+  int64_t pages_mtime_ns;
+} remfs_source;
+
+typedef kvec_t(remfs_source) remfs_source_vec;
+
 struct uuid_map_node;
 typedef kvec_t(struct uuid_map_node *) children_vec;
 
+// A directory's entries hashed by visible name, for resolving paths one
+// component at a time.
+typedef struct {
+  struct uuid_map_node **slots;
+  size_t mask;
+} child_table;
+
 typedef struct uuid_map_node {
   remfs_file *file;
-  char *path;
+  // The directory listing this node: its parent, or NULL for the root.
+  struct uuid_map_node *dir;
   children_vec children;
-  RB_ENTRY(uuid_map_node) fwdp;
-  RB_ENTRY(uuid_map_node) revp;
+  child_table names;
 } uuid_map_node;
 
-typedef RB_HEAD(uuid_fwd_map, uuid_map_node) uuid_fwd_map;
-typedef RB_HEAD(uuid_rev_map, uuid_map_node) uuid_rev_map;
-
+/*
+ * One generation of the index. Once built by remfs_init it is never
+ * modified, so any number of threads may read it without locking for as
+ * long as they hold a reference.
+ */
 typedef struct {
   char *src_dir;
+  strpool *strings;
   remfs_file_vec fv;
-  uuid_fwd_map *fwd_map;
-  uuid_rev_map *rev_map;
+  remfs_source_vec sources;
+  int64_t dir_mtime_ns;
+  // Nodes of live records, found by uuid through an open-addressing table
+  // over their binary ids.
+  uuid_map_node *nodes;
+  size_t num_nodes;
+  uuid_map_node **uuid_table;
+  size_t uuid_mask;
   children_vec root_children;
+  child_table root_names;
+  uint64_t generation;
+  int refcount;
 } remfs_ctx;
 
-int remfs_list(const char *path, remfs_file_vec *fv);
+/*
+ * Publishes the current remfs_ctx generation. Readers pin it with
+ * remfs_acquire/remfs_release; remfs_reload builds the next generation
+ * off to the side and swaps the pointer, so lookups never wait on a
+ * rescan. When cache_dir is set, the index is also persisted there on open
+ * and close, and reopening only re-reads entries whose files changed.
+ */
+typedef struct {
+  char *src_dir;
+  remfs_ctx *current;
+  uint64_t generation;
+  uint64_t saved_generation;
+  pthread_rwlock_t lock;
+  pthread_mutex_t reload_lock;
+} remfs_index;
+
+int remfs_list(const char *path, strpool *strings, remfs_file_vec *fv);
+// remfs_init and remfs_update return NULL if the scan ran out of memory.
 remfs_ctx *remfs_init(const char *src_dir);
+// Builds the generation after prev, re-reading only the sidecars of the given
+// uuids (documents or collections) and reusing every other record as is.
+remfs_ctx *remfs_update(remfs_ctx *prev, const char **uuids, size_t n);
 uuid_map_node *remfs_path_search(remfs_ctx *ctx, const char *path);
 uuid_map_node *remfs_uuid_search(remfs_ctx *ctx, const char *uuid);
 void remfs_destroy(remfs_ctx *arg);
 void remfs_print(remfs_ctx *arg, FILE *stream);
-void remfs_reload(remfs_ctx *ctx);
+
+// NULL if the first scan ran out of memory.
+remfs_index *remfs_index_open(const char *src_dir);
+void remfs_index_close(remfs_index *idx);
+remfs_ctx *remfs_acquire(remfs_index *idx);
+void remfs_release(remfs_ctx *ctx);
+// A reload or refresh whose scan fails keeps the current generation.
+void remfs_reload(remfs_index *idx);
+// Like remfs_reload, but only rescans the given uuids.
+void remfs_refresh(remfs_index *idx, const char **uuids, size_t n);
 
 #endif
@@ -0,0 +1,242 @@
+#include "remfs_watch.h"
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+
+// A batch is applied once the directory has been quiet for
+// WATCH_DEBOUNCE_MS, or WATCH_MAX_DELAY_MS after its first event if the
+// changes keep coming.
+#define WATCH_DEBOUNCE_MS 250
+#define WATCH_MAX_DELAY_MS 2000
+
+#define ROOT_MASK                                                              \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+#define PAGES_MASK                                                             \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE)
+
+typedef struct {
+  int wd;
+  char uuid[64];
+} page_dir_watch;
+
+struct remfs_watch {
+  remfs_index *idx;
+  int fd;
+  int root_wd;
+  int stop_pipe[2];
+  pthread_t thread;
+  kvec_t(page_dir_watch) dirs;
+};
+
+typedef struct {
+  kvec_t(sds) uuids;
+  bool overflow;
+  long first_ms;
+} watch_batch;
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool has_suffix(const char *name, const char *suffix) {
+  size_t n = strlen(name), m = strlen(suffix);
+  return n > m && strcmp(name + n - m, suffix) == 0;
+}
+
+static void batch_add(watch_batch *b, const char *name, size_t len) {
+  if (len == 0 || len >= 64)
+    return;
+  if (kv_size(b->uuids) == 0 && !b->overflow)
+    b->first_ms = now_ms();
+  kv_push(sds, b->uuids, sdsnewlen(name, len));
+}
+
+static void watch_page_dir(remfs_watch *w, const char *uuid) {
+  sds dir = sdscatprintf(sdsempty(), "%s/%s", w->idx->src_dir, uuid);
+  int wd = inotify_add_watch(w->fd, dir, PAGES_MASK | IN_ONLYDIR);
+  sdsfree(dir);
+  if (wd < 0)
+    return;
+  for (size_t i = 0; i < kv_size(w->dirs); i++) {
+    if (kv_A(w->dirs, i).wd == wd)
+      return;
+  }
+  page_dir_watch pw = {.wd = wd};
+  snprintf(pw.uuid, sizeof(pw.uuid), "%s", uuid);
+  kv_push(page_dir_watch, w->dirs, pw);
+}
+
+static page_dir_watch *find_page_dir(remfs_watch *w, int wd) {
+  for (size_t i = 0; i < kv_size(w->dirs); i++) {
+    if (kv_A(w->dirs, i).wd == wd)
+      return &kv_A(w->dirs, i);
+  }
+  return NULL;
+}
+
+static void handle_event(remfs_watch *w, const struct inotify_event *ev,
+                         watch_batch *b) {
+  if (ev->mask & IN_Q_OVERFLOW) {
+    if (kv_size(b->uuids) == 0 && !b->overflow)
+      b->first_ms = now_ms();
+    b->overflow = true;
+    return;
+  }
+  if (ev->len == 0)
+    return;
+
+  if (ev->wd == w->root_wd) {
+    if (ev->mask & IN_ISDIR) {
+      // A new page directory may already hold .rm files by the time it is
+      // watched, so the document is rescanned either way.
+      if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        watch_page_dir(w, ev->name);
+      batch_add(b, ev->name, strlen(ev->name));
+      return;
+    }
+    const char *dot = strrchr(ev->name, '.');
+    if (dot && (has_suffix(ev->name, ".metadata") ||
+                has_suffix(ev->name, ".content") ||
+                has_suffix(ev->name, ".pagedata")))
+      batch_add(b, ev->name, dot - ev->name);
+    return;
+  }
+
+  page_dir_watch *pw = find_page_dir(w, ev->wd);
+  if (!pw)
+    return;
+  // The index keeps each page's size and mtime, so rewriting a page
+  // rescans its document as well.
+  if (has_suffix(ev->name, ".rm"))
+    batch_add(b, pw->uuid, strlen(pw->uuid));
+}
+
+static void forget_page_dir(remfs_watch *w, int wd) {
+  for (size_t i = 0; i < kv_size(w->dirs); i++) {
+    if (kv_A(w->dirs, i).wd == wd) {
+      kv_A(w->dirs, i) = kv_A(w->dirs, kv_size(w->dirs) - 1);
+      kv_size(w->dirs)--;
+      return;
+    }
+  }
+}
+
+static void flush_batch(remfs_watch *w, watch_batch *b) {
+  if (b->overflow) {
+    remfs_reload(w->idx);
+  } else if (kv_size(b->uuids) > 0) {
+    remfs_refresh(w->idx, (const char **)b->uuids.a, kv_size(b->uuids));
+  }
+  for (size_t i = 0; i < kv_size(b->uuids); i++)
+    sdsfree(kv_A(b->uuids, i));
+  kv_size(b->uuids) = 0;
+  b->overflow = false;
+}
+
+static void *watch_thread(void *arg) {
+  remfs_watch *w = arg;
+  watch_batch b = {0};
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  for (;;) {
+    bool pending = kv_size(b.uuids) > 0 || b.overflow;
+    int timeout = -1;
+    if (pending) {
+      long left = b.first_ms + WATCH_MAX_DELAY_MS - now_ms();
+      timeout = left < WATCH_DEBOUNCE_MS ? (left > 0 ? (int)left : 0)
+                                         : WATCH_DEBOUNCE_MS;
+    }
+    struct pollfd fds[2] = {{.fd = w->fd, .events = POLLIN},
+                            {.fd = w->stop_pipe[0], .events = POLLIN}};
+    int r = poll(fds, 2, timeout);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (r == 0 || (pending && now_ms() - b.first_ms >= WATCH_MAX_DELAY_MS)) {
+      flush_batch(w, &b);
+      if (r == 0)
+        continue;
+    }
+
+    ssize_t len = read(w->fd, buf, sizeof(buf));
+    if (len <= 0)
+      continue;
+    for (char *p = buf; p < buf + len;) {
+      const struct inotify_event *ev = (const struct inotify_event *)p;
+      if (ev->mask & IN_IGNORED)
+        forget_page_dir(w, ev->wd);
+      else
+        handle_event(w, ev, &b);
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  flush_batch(w, &b);
+  kv_destroy(b.uuids);
+  return NULL;
+}
+
+remfs_watch *remfs_watch_start(remfs_index *idx) {
+  remfs_watch *w = calloc(1, sizeof(remfs_watch));
+  if (!w)
+    return NULL;
+  w->idx = idx;
+  w->fd = inotify_init1(IN_CLOEXEC);
+  if (w->fd < 0) {
+    free(w);
+    return NULL;
+  }
+  w->root_wd = inotify_add_watch(w->fd, idx->src_dir, ROOT_MASK);
+  if (w->root_wd < 0 || pipe(w->stop_pipe) != 0) {
+    close(w->fd);
+    free(w);
+    return NULL;
+  }
+
+  DIR *dir = opendir(idx->src_dir);
+  if (dir) {
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+      if (de->d_name[0] != '.' &&
+          (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN))
+        watch_page_dir(w, de->d_name);
+    }
+    closedir(dir);
+  }
+
+  if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+    close(w->stop_pipe[0]);
+    close(w->stop_pipe[1]);
+    close(w->fd);
+    kv_destroy(w->dirs);
+    free(w);
+    return NULL;
+  }
+  return w;
+}
+
+void remfs_watch_stop(remfs_watch *w) {
+  if (!w)
+    return;
+  char c = 0;
+  if (write(w->stop_pipe[1], &c, 1) == 1)
+    pthread_join(w->thread, NULL);
+  close(w->stop_pipe[0]);
+  close(w->stop_pipe[1]);
+  close(w->fd);
+  kv_destroy(w->dirs);
+  free(w);
+}
@@ -0,0 +1,16 @@
+#ifndef REMFS_WATCH_H
+#define REMFS_WATCH_H
+
+#include "remfs.h"
+
+/*
+ * Watches an index's data directory (and each document's page directory)
+ * with inotify. Changed uuids are collected, debounced and handed to
+ * remfs_refresh in one batch; a queue overflow falls back to remfs_reload.
+ */
+typedef struct remfs_watch remfs_watch;
+
+remfs_watch *remfs_watch_start(remfs_index *idx);
+void remfs_watch_stop(remfs_watch *w);
+
+#endif /* REMFS_WATCH_H */
@@ -22,6 +22,9 @@
 #include "generators.h"
 #include "path_utils.h"
 #include "remfuse.h"
+#include "remfs_watch.h"
+#include "render_pool.h"
+#include "rm_parser.h"
 
 bool enable_svg = true;
 bool enable_png = true;
@@ -32,8 +35,83 @@ bool enable_standalone_annotations = false;
 char *template_dir = NULL;
 char *data_dir = NULL;
 
+int render_threads = 0;
+
+// Serializes writes to data_dir. Index lookups go through remfs_acquire and
+// renders through the render pool; neither takes it.
 pthread_mutex_t remfs_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Picks up changes made to data_dir behind our back, e.g. by a sync.
+static remfs_watch *watcher = NULL;
+
+typedef struct {
+  remfs_ctx *ctx;
+  uuid_map_node *ref;
+  const char *newpath;
+  int flags;
+} render_request;
+
+static cache_entry *render_virtual(void *arg) {
+  render_request *req = arg;
+  uuid_map_node *ref = req->ref;
+  int flags = req->flags;
+  if (flags & IS_SVG)
+    return generate_fake_ext(ref, req->newpath, flags & IS_ANNOT_PAGE, "svg");
+  if (flags & IS_ANNOTATED_PDF)
+    return generate_annotated_pdf(req->ctx, ref, req->newpath);
+  if ((flags & IS_PDF) && ref->file->filetype == NOTEBOOK)
+    return generate_notebook_pdf(req->ctx, ref);
+  if (flags & IS_PDF)
+    return generate_fake_ext(ref, req->newpath, flags & IS_ANNOT_PAGE, "pdf");
+  if (flags & IS_XOJ)
+    return generate_fake_ext(ref, req->newpath, false, "xoj");
+  return generate_fake_ext(ref, req->newpath, flags & IS_ANNOT_PAGE, "png");
+}
+
+// The cache version render_virtual would store its result under, if it can
+// be had without reading any page.
+static bool render_version(render_request *req, uint64_t *version) {
+  uuid_map_node *ref = req->ref;
+  int flags = req->flags;
+  bool anot = flags & IS_ANNOT_PAGE;
+  if (flags & IS_SVG)
+    return fake_ext_version(ref, req->newpath, anot, "svg", version);
+  if (flags & IS_ANNOTATED_PDF)
+    return annotated_pdf_version(req->ctx, ref, req->newpath, version);
+  if ((flags & IS_PDF) && ref->file->filetype == NOTEBOOK)
+    return notebook_pdf_version(req->ctx, ref, version);
+  if (flags & IS_PDF)
+    return fake_ext_version(ref, req->newpath, anot, "pdf", version);
+  if (flags & IS_XOJ)
+    return fake_ext_version(ref, req->newpath, false, "xoj", version);
+  return fake_ext_version(ref, req->newpath, anot, "png", version);
+}
+
+static const char *render_type(int flags) {
+  if (flags & IS_SVG)
+    return "svg";
+  if (flags & IS_PDF)
+    return "pdf";
+  if (flags & IS_XOJ)
+    return "xoj";
+  return "png";
+}
+
+// Size of a virtual file when it can be had without rendering: from a
+// render already cached, or for PNGs worked out from the page. getattr
+// reports 0 otherwise, and open serves such files with direct_io.
+static bool render_size(render_request *req, size_t *size) {
+  uuid_map_node *ref = req->ref;
+  int flags = req->flags;
+  uint64_t version;
+  if (render_version(req, &version) &&
+      cached_render_size(ref->file->uuid, render_type(flags), version, size))
+    return true;
+  if (flags & IS_PNG)
+    return fake_png_size(ref, req->newpath, flags & IS_ANNOT_PAGE, size);
+  return false;
+}
+
 static int remfuse_getattr_internal(remfs_ctx *ctx, const char *path,
                                     struct stat *stbuf) {
   int ret = -ENOENT;
@@ -124,77 +202,27 @@ static int remfuse_getattr_internal(remfs_ctx *ctx, const char *path,
           if (ref->file->filetype == NOTEBOOK && (flags & IS_PDF)) {
             stbuf->st_mode = S_IFREG | 0444;
             stbuf->st_nlink = 1;
-            sds meta_path = sdscatprintf(sdsempty(), "%s/%s.metadata",
-                                         ctx->src_dir, ref->file->uuid);
-            struct stat meta_st;
-            time_t latest_mtime = 1;
-            if (stat(meta_path, &meta_st) == 0) {
-              latest_mtime = meta_st.st_mtime;
-            }
-            sdsfree(meta_path);
-
-            cache_entry *cached =
-                get_cached_entry(ref->file->uuid, "pdf", latest_mtime);
-            if (cached) {
-              stbuf->st_size = cached->size;
-              stbuf->st_mtime = cached->mtime;
-              release_cached_entry(cached);
-            } else {
-              stbuf->st_size = ref->file->page_count * 15 * 1024 * 1024;
-              if (stbuf->st_size < 15 * 1024 * 1024) {
-                stbuf->st_size = 15 * 1024 * 1024;
-              }
-              stbuf->st_mtime = latest_mtime;
-            }
+            // The index has the latest mtime of the document and its pages.
+            stbuf->st_mtim.tv_sec = ref->file->mtime_ns / 1000000000;
+            stbuf->st_mtim.tv_nsec = ref->file->mtime_ns % 1000000000;
+            if (stbuf->st_mtime == 0)
+              stbuf->st_mtime = 1;
+
+            render_request req = {ctx, ref, newpath, flags};
+            size_t size = 0;
+            render_size(&req, &size);
+            stbuf->st_size = size;
             ret = 0;
           } else {
             ret = stat(newpath, stbuf);
-            if (ret == 0) {
-              const char *type_str =
-                  (flags & IS_SVG)
-                      ? "svg"
-                      : ((flags & IS_PDF) ? "pdf"
-                                          : ((flags & IS_XOJ) ? "xoj" : "png"));
-              if (ref->file->filetype == PDF && (flags & IS_PDF)) {
-                if (flags & IS_ANNOTATED_PDF) {
-                  cache_entry *entry =
-                      generate_annotated_pdf(ctx, ref, newpath);
-                  if (entry) {
-                    stbuf->st_size = entry->size;
-                    release_cached_entry(entry);
-                  }
-                }
-              } else {
-                time_t latest_mtime = stbuf->st_mtime;
-                for (size_t i = 0; i < kv_size(ref->children); i++) {
-                  uuid_map_node *page = kv_A(ref->children, i);
-                  if (page && page->file->filetype == PAGE) {
-                    sds rm_path =
-                        sdscatprintf(sdsempty(), "%s/%s/%s.rm", ctx->src_dir,
-                                     ref->file->uuid, page->file->uuid);
-                    struct stat rm_st;
-                    if (stat(rm_path, &rm_st) == 0) {
-                      if (rm_st.st_mtime > latest_mtime) {
-                        latest_mtime = rm_st.st_mtime;
-                      }
-                    }
-                    sdsfree(rm_path);
-                  }
-                }
-                cache_entry *cached =
-                    get_cached_entry(ref->file->uuid, type_str, latest_mtime);
-                if (cached) {
-                  stbuf->st_size = cached->size;
-                  release_cached_entry(cached);
-                } else {
-                  if (strcmp(type_str, "png") == 0 ||
-                      strcmp(type_str, "pdf") == 0) {
-                    stbuf->st_size = 15 * 1024 * 1024;
-                  } else {
-                    stbuf->st_size = 5 * 1024 * 1024;
-                  }
-                }
-              }
+            // The original of a PDF is served as is; anything else is
+            // rendered on open.
+            if (ret == 0 && (ref->file->filetype != PDF || !(flags & IS_PDF) ||
+                             (flags & IS_ANNOTATED_PDF))) {
+              render_request req = {ctx, ref, newpath, flags};
+              size_t size = 0;
+              render_size(&req, &size);
+              stbuf->st_size = size;
             }
           }
         } else if ((flags & (IS_SVG | IS_PNG | IS_PDF | IS_XOJ)) && !allowed) {
@@ -227,10 +255,9 @@ static int remfuse_getattr(const char *path, struct stat *stbuf,
 static int remfuse_getattr(const char *path, struct stat *stbuf) {
 #endif
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
-  pthread_mutex_lock(&remfs_mutex);
+  remfs_ctx *ctx = remfs_acquire((remfs_index *)fuse_ctx->private_data);
   int ret = remfuse_getattr_internal(ctx, path, stbuf);
-  pthread_mutex_unlock(&remfs_mutex);
+  remfs_release(ctx);
   return ret;
 }
 
@@ -286,9 +313,8 @@ static int remfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                            off_t offset, struct fuse_file_info *fi) {
 #endif
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire((remfs_index *)fuse_ctx->private_data);
 
-  pthread_mutex_lock(&remfs_mutex);
   children_vec *n = NULL;
   int flags = 0;
   if (strcmp(path, "/") == 0) {
@@ -300,7 +326,7 @@ static int remfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
   }
 
   if (!n) {
-    pthread_mutex_unlock(&remfs_mutex);
+    remfs_release(ctx);
     return -ENOENT;
   }
 
@@ -408,7 +434,7 @@ static int remfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
       }
     }
   }
-  pthread_mutex_unlock(&remfs_mutex);
+  remfs_release(ctx);
   return 0;
 }
 
@@ -419,19 +445,19 @@ static int remfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 static int remfuse_open(const char *path, struct fuse_file_info *fi) {
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire((remfs_index *)fuse_ctx->private_data);
 
-  pthread_mutex_lock(&remfs_mutex);
+  int ret = 0;
   int flags = 0;
   sds newpath = sdsempty();
   uuid_map_node *ref = rewrite_path(ctx, path, &flags, &newpath);
+  cache_entry *entry = NULL;
 
   if ((fi->flags & (O_WRONLY | O_RDWR)) &&
       (!enable_mutable ||
        (flags & (IS_ANNOTATED_PDF | IS_SVG | IS_PNG | IS_PDF | IS_XOJ)))) {
-    sdsfree(newpath);
-    pthread_mutex_unlock(&remfs_mutex);
-    return -EROFS;
+    ret = -EROFS;
+    goto out;
   }
 
   if (flags & (IS_SVG | IS_PNG | IS_PDF | IS_XOJ)) {
@@ -445,100 +471,57 @@ static int remfuse_open(const char *path, struct fuse_file_info *fi) {
     if ((flags & IS_XOJ) && enable_xoj)
       allowed = true;
     if (!allowed) {
-      sdsfree(newpath);
-      pthread_mutex_unlock(&remfs_mutex);
-      return -ENOENT;
+      ret = -ENOENT;
+      goto out;
     }
   }
 
-  if (ref && (flags & IS_SVG) && enable_svg) {
-    cache_entry *entry =
-        generate_fake_ext(ref, newpath, flags & IS_ANNOT_PAGE, "svg");
-    sdsfree(newpath);
-    if (!entry) {
-      pthread_mutex_unlock(&remfs_mutex);
-      return -ENOENT;
-    }
-    fi->fh = MAKE_CACHE_PTR(entry);
-    pthread_mutex_unlock(&remfs_mutex);
-    return 0;
-  } else if (ref && (flags & IS_PDF) && enable_pdf) {
-    cache_entry *entry = NULL;
-    if (flags & IS_ANNOTATED_PDF) {
-      entry = generate_annotated_pdf(ctx, ref, newpath);
-      if (entry) {
-        sdsfree(newpath);
-        fi->fh = MAKE_CACHE_PTR(entry);
-        pthread_mutex_unlock(&remfs_mutex);
-        return 0;
-      }
-      sdsfree(newpath);
-      pthread_mutex_unlock(&remfs_mutex);
-      return -ENOENT;
-    } else {
-      if (ref->file->filetype == PDF) {
-        int fd = open(newpath, fi->flags);
-        sdsfree(newpath);
-        if (fd == -1) {
-          pthread_mutex_unlock(&remfs_mutex);
-          return -errno;
-        }
-        fi->fh = fd;
-        pthread_mutex_unlock(&remfs_mutex);
-        return 0;
-      } else if (ref->file->filetype == NOTEBOOK) {
-        entry = generate_notebook_pdf(ctx, ref);
-      } else {
-        entry = generate_fake_ext(ref, newpath, flags & IS_ANNOT_PAGE, "pdf");
-      }
-      if (entry) {
-        sdsfree(newpath);
-        fi->fh = MAKE_CACHE_PTR(entry);
-        pthread_mutex_unlock(&remfs_mutex);
-        return 0;
-      }
-      sdsfree(newpath);
-      pthread_mutex_unlock(&remfs_mutex);
-      return -ENOENT;
-    }
-  } else if (ref && (flags & IS_XOJ) && enable_xoj) {
-    cache_entry *entry = generate_fake_ext(ref, newpath, false, "xoj");
-    if (entry) {
-      fi->fh = MAKE_CACHE_PTR(entry);
-      sdsfree(newpath);
-      pthread_mutex_unlock(&remfs_mutex);
-      return 0;
-    }
-    sdsfree(newpath);
-    pthread_mutex_unlock(&remfs_mutex);
-    return -ENOENT;
-  } else if (ref && (flags & IS_PNG) && enable_png) {
-    cache_entry *entry =
-        generate_fake_ext(ref, newpath, flags & IS_ANNOT_PAGE, "png");
-    sdsfree(newpath);
-    if (!entry) {
-      pthread_mutex_unlock(&remfs_mutex);
-      return -ENOENT;
-    }
-    fi->fh = MAKE_CACHE_PTR(entry);
-    pthread_mutex_unlock(&remfs_mutex);
-    return 0;
-  } else {
-    if (sdslen(newpath) == 0) {
-      sdsfree(newpath);
-      pthread_mutex_unlock(&remfs_mutex);
-      return -1;
-    }
+  if (ref && (flags & IS_PDF) && !(flags & IS_ANNOTATED_PDF) &&
+      ref->file->filetype == PDF) {
     int fd = open(newpath, fi->flags);
-    sdsfree(newpath);
     if (fd == -1) {
-      pthread_mutex_unlock(&remfs_mutex);
-      return -errno;
+      ret = -errno;
+      goto out;
     }
     fi->fh = fd;
-    pthread_mutex_unlock(&remfs_mutex);
-    return 0;
+    goto out;
+  }
+
+  if (ref && (flags & (IS_SVG | IS_PNG | IS_PDF | IS_XOJ))) {
+    render_request req = {ctx, ref, newpath, flags};
+    entry = render_pool_run(render_virtual, &req);
+    if (!entry) {
+      ret = -ENOENT;
+      goto out;
+    }
+    // The kernel holds whatever size getattr last reported. That is this
+    // render's own size only if getattr took it from this entry or, for a
+    // PNG, sized the page the render came out at. Otherwise reads must not
+    // be cut short or padded to it.
+    size_t png_size;
+    if (!__atomic_load_n(&entry->size_reported, __ATOMIC_RELAXED) &&
+        !((flags & IS_PNG) &&
+          fake_png_size(ref, newpath, flags & IS_ANNOT_PAGE, &png_size) &&
+          png_size == entry->size))
+      fi->direct_io = 1;
+    fi->fh = MAKE_CACHE_PTR(entry);
+    goto out;
   }
+
+  if (sdslen(newpath) == 0) {
+    ret = -1;
+    goto out;
+  }
+  int fd = open(newpath, fi->flags);
+  if (fd == -1) {
+    ret = -errno;
+    goto out;
+  }
+  fi->fh = fd;
+out:
+  sdsfree(newpath);
+  remfs_release(ctx);
+  return ret;
 }
 
 static sds sds_append_varuint(sds s, uint32_t val) {
@@ -838,7 +821,9 @@ static int remfuse_release(const char *path, struct fuse_file_info *fi) {
   if (is_xoj && enable_mutable) {
     pthread_mutex_lock(&remfs_mutex);
     struct fuse_context *fuse_ctx = fuse_get_context();
-    remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+    remfs_index *idx = (remfs_index *)fuse_ctx->private_data;
+    remfs_ctx *ctx = remfs_acquire(idx);
+    char doc_uuid[64] = "";
 
     sds parent_path = sdsempty();
     sds name = sdsempty();
@@ -859,7 +844,6 @@ static int remfuse_release(const char *path, struct fuse_file_info *fi) {
       int parse_ret = parse_xoj_file(temp_path, &pages, &num_pages);
 
       if (parse_ret == 0 && num_pages > 0) {
-        char doc_uuid[64];
         gen_uuid(doc_uuid);
 
         sds dir_path =
@@ -958,9 +942,13 @@ static int remfuse_release(const char *path, struct fuse_file_info *fi) {
 
     sdsfree(parent_path);
     sdsfree(name);
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
 
-    remfs_reload(ctx);
+    if (doc_uuid[0]) {
+      const char *changed = doc_uuid;
+      remfs_refresh(idx, &changed, 1);
+    }
   }
 
   return 0;
@@ -1015,22 +1003,21 @@ static int remfuse_truncate(const char *path, off_t size) {
     return -EROFS;
   }
 
-  pthread_mutex_lock(&remfs_mutex);
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire((remfs_index *)fuse_ctx->private_data);
 
   int flags = 0;
   sds newpath = sdsempty();
   rewrite_path(ctx, path, &flags, &newpath);
   if (sdslen(newpath) == 0) {
     sdsfree(newpath);
-    pthread_mutex_unlock(&remfs_mutex);
+    remfs_release(ctx);
     return -ENOENT;
   }
 
   int ret = truncate(newpath, size);
   sdsfree(newpath);
-  pthread_mutex_unlock(&remfs_mutex);
+  remfs_release(ctx);
 
   if (ret == -1)
     return -errno;
@@ -1049,7 +1036,8 @@ static int remfuse_rmdir(const char *path) {
 
   pthread_mutex_lock(&remfs_mutex);
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_index *idx = (remfs_index *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire(idx);
 
   int flags = 0;
   sds newpath = sdsempty();
@@ -1057,11 +1045,13 @@ static int remfuse_rmdir(const char *path) {
   sdsfree(newpath);
 
   if (!ref) {
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return -ENOENT;
   }
 
   if (ref->file->type != DOCUMENT || ref->file->filetype != NOTEBOOK) {
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return -EPERM;
   }
@@ -1090,9 +1080,13 @@ static int remfuse_rmdir(const char *path) {
     free(raw_meta);
   }
   sdsfree(meta_path);
+  char uuid[64];
+  snprintf(uuid, sizeof(uuid), "%s", ref->file->uuid);
+  const char *changed = uuid;
+  remfs_release(ctx);
   pthread_mutex_unlock(&remfs_mutex);
 
-  remfs_reload(ctx);
+  remfs_refresh(idx, &changed, 1);
   return 0;
 }
 
@@ -1108,7 +1102,8 @@ static int remfuse_unlink(const char *path) {
 
   pthread_mutex_lock(&remfs_mutex);
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_index *idx = (remfs_index *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire(idx);
 
   int flags = 0;
   sds newpath = sdsempty();
@@ -1116,11 +1111,13 @@ static int remfuse_unlink(const char *path) {
   sdsfree(newpath);
 
   if (!ref) {
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return -ENOENT;
   }
 
   if (ref->file->type != DOCUMENT) {
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return -EPERM;
   }
@@ -1149,9 +1146,13 @@ static int remfuse_unlink(const char *path) {
     free(raw_meta);
   }
   sdsfree(meta_path);
+  char uuid[64];
+  snprintf(uuid, sizeof(uuid), "%s", ref->file->uuid);
+  const char *changed = uuid;
+  remfs_release(ctx);
   pthread_mutex_unlock(&remfs_mutex);
 
-  remfs_reload(ctx);
+  remfs_refresh(idx, &changed, 1);
   return 0;
 }
 
@@ -1166,7 +1167,8 @@ static int remfuse_create(const char *path, mode_t mode,
 
   pthread_mutex_lock(&remfs_mutex);
   struct fuse_context *fuse_ctx = fuse_get_context();
-  remfs_ctx *ctx = (remfs_ctx *)fuse_ctx->private_data;
+  remfs_index *idx = (remfs_index *)fuse_ctx->private_data;
+  remfs_ctx *ctx = remfs_acquire(idx);
   sds parent_path = sdsempty();
   sds name = sdsempty();
   get_parent_and_name(path, &parent_path, &name);
@@ -1186,6 +1188,7 @@ static int remfuse_create(const char *path, mode_t mode,
     if (parent_node && parent_node->file->type != COLLECTION) {
       sdsfree(parent_path);
       sdsfree(name);
+      remfs_release(ctx);
       pthread_mutex_unlock(&remfs_mutex);
       return -ENOTDIR;
     }
@@ -1199,16 +1202,19 @@ static int remfuse_create(const char *path, mode_t mode,
     sdsfree(name);
 
     if (fd == -1) {
+      remfs_release(ctx);
       pthread_mutex_unlock(&remfs_mutex);
       return -errno;
     }
     fi->fh = fd;
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return 0;
   } else if (is_pdf || is_epub) {
     if (parent_node && parent_node->file->type != COLLECTION) {
       sdsfree(parent_path);
       sdsfree(name);
+      remfs_release(ctx);
       pthread_mutex_unlock(&remfs_mutex);
       return -ENOTDIR;
     }
@@ -1281,17 +1287,21 @@ static int remfuse_create(const char *path, mode_t mode,
     sdsfree(name);
 
     if (fd == -1) {
+      remfs_release(ctx);
       pthread_mutex_unlock(&remfs_mutex);
       return -errno;
     }
     fi->fh = fd;
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
 
-    remfs_reload(ctx);
+    const char *changed = doc_uuid;
+    remfs_refresh(idx, &changed, 1);
     return 0;
   } else {
     sdsfree(parent_path);
     sdsfree(name);
+    remfs_release(ctx);
     pthread_mutex_unlock(&remfs_mutex);
     return -EINVAL;
   }
@@ -1315,13 +1325,23 @@ static void *remfuse_init(struct fuse_conn_info *conn,
 static void *remfuse_init(struct fuse_conn_info *conn) {
 #endif
   const char *src = data_dir ? data_dir : DEFAULT_SOURCE;
-  remfs_ctx *ctx = remfs_init(src);
-  return ctx;
+  render_pool_start(render_threads);
+  remfs_index *idx = remfs_index_open(src);
+  if (!idx) {
+    fprintf(stderr, "failed to index data dir [%s]: out of memory\n", src);
+    exit(1);
+  }
+  watcher = remfs_watch_start(idx);
+  return idx;
 }
 
 static void remfuse_destroy(void *arg) {
-  remfs_ctx *ctx = (remfs_ctx *)arg;
-  remfs_destroy(ctx);
+  remfs_index *idx = (remfs_index *)arg;
+  remfs_watch_stop(watcher);
+  watcher = NULL;
+  render_pool_stop();
+  remfs_index_close(idx);
+  remfmt_resume_cleanup();
 }
 
 struct fuse_operations remfuse_ops = {
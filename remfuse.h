@@ -28,6 +28,7 @@ extern bool enable_mutable;
 extern bool enable_standalone_annotations;
 extern char *template_dir;
 extern char *data_dir;
+extern int render_threads;
 
 extern pthread_mutex_t remfs_mutex;
 
@@ -1,165 +1,167 @@
 #include "render_pdf.h"
+#include "rm_parser.h"
 #include "template_renderer.h"
 #include <math.h>
 
-void remfmt_render_pdf(FILE *stream, remfmt_stroke_vec *strokes,
-                       remfmt_render_params *prm) {
-  float min_x = 0.0f;
-  float max_x = (float)DEV_W;
-  float min_y = 0.0f;
-  float max_y = (float)DEV_H;
-
-  if (strokes != NULL && !(prm && prm->annotation)) {
-    for (int i = 0; i < kv_size(*strokes); i++) {
-      remfmt_stroke *st = &kv_A(*strokes, i);
-      float xOffset = (st->version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-      for (int j = 0; j < kv_size(st->segments); j++) {
-        remfmt_seg sg = kv_A(st->segments, j);
-        float x = sg.x + xOffset;
-        float y = sg.y;
-        if (x < min_x)
-          min_x = x;
-        if (x > max_x)
-          max_x = x;
-        if (y < min_y)
-          min_y = y;
-        if (y > max_y)
-          max_y = y;
+// A page's drawing as it is built up: strokes are moved by min_x and min_y
+// and, in landscape, turned onto a page height high.
+typedef struct {
+  sds content;
+  float min_x;
+  float min_y;
+  int port_h;
+  int height;
+  bool landscape;
+} pdf_page;
+
+// Appends st to the page; a remfmt_stroke_fn for remfmt_parse_each.
+static bool pdf_stroke(const remfmt_stroke *stroke, void *ctx) {
+  pdf_page *pg = ctx;
+  remfmt_stroke st = *stroke;
+  const remfmt_points *p = &st.points;
+  set_pen_attr(&st);
+
+  if (st.pen == 99) { /* PEN_IMAGE */
+    if (p->n > 1) {
+      float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
+      float left = p->x[0] + xOffset - pg->min_x;
+      float top = p->y[0] - pg->min_y;
+      float w = p->x[1] - p->x[0];
+      float h = p->y[1] - p->y[0];
+
+      float x_pdf = left;
+      float y_pdf = (float)pg->height - (top + h);
+      float w_pdf = w;
+      float h_pdf = h;
+
+      if (pg->landscape) {
+        x_pdf = (float)pg->port_h - (top + h);
+        y_pdf = (float)pg->height - (left + w);
+        w_pdf = h;
+        h_pdf = w;
       }
+
+      pg->content = sdscatprintf(pg->content, "q\n");
+      pg->content = sdscatprintf(pg->content, "0.5 0.5 0.5 RG\n");
+      pg->content = sdscatprintf(pg->content, "1 w\n");
+      pg->content = sdscatprintf(pg->content, "%.3f %.3f %.3f %.3f re\n",
+                                 x_pdf, y_pdf, w_pdf, h_pdf);
+      pg->content = sdscatprintf(pg->content, "S\nQ\n");
     }
+    return true;
   }
 
-  int port_w = (int)ceilf(max_x - min_x);
-  int port_h = (int)ceilf(max_y - min_y);
+  int num_points = p->n;
+  if (num_points == 0)
+    return true;
 
-  int width = port_w;
-  int height = port_h;
-  if (prm && prm->landscape) {
-    width = port_h;
-    height = port_w;
+  uint32_t seg_color;
+  if (st.has_custom_color) {
+    seg_color = st.custom_color;
+  } else {
+    seg_color = (st.color < 14) // size of svg_color array
+                    ? svg_color[st.color]
+                    : 0x000000;
   }
 
-  sds pdf_content = sdsempty();
-  if (strokes != NULL) {
-    for (int i = 0; i < kv_size(*strokes); i++) {
-      remfmt_stroke st = kv_A(*strokes, i);
-      set_pen_attr(&st);
-
-      if (st.pen == 99) { /* PEN_IMAGE */
-        if (kv_size(st.segments) > 0) {
-          remfmt_seg first_sg = kv_A(st.segments, 0);
-          float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-          float left = first_sg.x + xOffset - min_x;
-          float top = first_sg.y - min_y;
-          float w = first_sg.width;
-          float h = first_sg.pressure;
-
-          float x_pdf = left;
-          float y_pdf = (float)height - (top + h);
-          float w_pdf = w;
-          float h_pdf = h;
-
-          if (prm && prm->landscape) {
-            x_pdf = (float)port_h - (top + h);
-            y_pdf = (float)height - (left + w);
-            w_pdf = h;
-            h_pdf = w;
-          }
-
-          pdf_content = sdscatprintf(pdf_content, "q\n");
-          pdf_content = sdscatprintf(pdf_content, "0.5 0.5 0.5 RG\n");
-          pdf_content = sdscatprintf(pdf_content, "1 w\n");
-          pdf_content = sdscatprintf(pdf_content, "%.3f %.3f %.3f %.3f re\n",
-                                     x_pdf, y_pdf, w_pdf, h_pdf);
-          pdf_content = sdscatprintf(pdf_content, "S\nQ\n");
-        }
-        continue;
-      }
+  float r = ((seg_color >> 16) & 0xff) / 255.0f;
+  float g = ((seg_color >> 8) & 0xff) / 255.0f;
+  float b = (seg_color & 0xff) / 255.0f;
 
-      int num_points = kv_size(st.segments);
-      if (num_points == 0)
-        continue;
+  float seg_width = st.calc_width, lsw = seg_width;
+  float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
 
-      uint32_t seg_color;
-      if (st.has_custom_color) {
-        seg_color = st.custom_color;
-      } else {
-        seg_color = (st.color < 14) // size of svg_color array
-                        ? svg_color[st.color]
-                        : 0x000000;
-      }
+  float seg_alpha = get_seg_alpha(&st, 0);
+  const char *gs_state = "/GS100";
+  if (st.pen == ERASER || st.pen == ERASE_AREA) {
+    gs_state = "/GS0";
+  } else {
+    if (seg_alpha < 0.15) {
+      gs_state = "/GS10";
+    } else if (seg_alpha < 0.35) {
+      gs_state = "/GS25";
+    } else if (seg_alpha < 0.95) {
+      gs_state = "/GS90";
+    }
+  }
 
-      float r = ((seg_color >> 16) & 0xff) / 255.0f;
-      float g = ((seg_color >> 8) & 0xff) / 255.0f;
-      float b = (seg_color & 0xff) / 255.0f;
+  pg->content = sdscatprintf(pg->content, "q\n");
+  pg->content = sdscatprintf(pg->content, "%s gs\n", gs_state);
+  pg->content = sdscatprintf(pg->content, "%.3f w\n", seg_width);
+  pg->content = sdscatprintf(pg->content, "%.3f %.3f %.3f RG\n", r, g, b);
+  pg->content = sdscatprintf(pg->content, "%d J\n", st.square_cap ? 2 : 1);
+  pg->content = sdscatprintf(pg->content, "1 j\n");
+
+  // First point
+  float x0 = p->x[0] + xOffset - pg->min_x;
+  float y0 = p->y[0] - pg->min_y;
+  if (pg->landscape) {
+    float rx = (float)pg->port_h - y0;
+    float ry = x0;
+    x0 = rx;
+    y0 = ry;
+  }
+  float yp0 = (float)pg->height - y0;
+  pg->content = sdscatprintf(pg->content, "%.3f %.3f m\n", x0, yp0);
 
-      float seg_width = st.calc_width, lsw = seg_width;
-      float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
+  if (num_points == 1) {
+    pg->content = sdscatprintf(pg->content, "%.3f %.3f l\n", x0, yp0);
+  }
 
-      float seg_alpha = get_seg_alpha(&st, &kv_A(st.segments, 0));
-      const char *gs_state = "/GS100";
-      if (st.pen == ERASER || st.pen == ERASE_AREA) {
-        gs_state = "/GS0";
-      } else {
-        if (seg_alpha < 0.15) {
-          gs_state = "/GS10";
-        } else if (seg_alpha < 0.35) {
-          gs_state = "/GS25";
-        } else if (seg_alpha < 0.95) {
-          gs_state = "/GS90";
-        }
-      }
+  for (int j = 1; j < num_points; j++) {
+    float x = p->x[j] + xOffset - pg->min_x;
+    float y = p->y[j] - pg->min_y;
 
-      pdf_content = sdscatprintf(pdf_content, "q\n");
-      pdf_content = sdscatprintf(pdf_content, "%s gs\n", gs_state);
-      pdf_content = sdscatprintf(pdf_content, "%.3f w\n", seg_width);
-      pdf_content = sdscatprintf(pdf_content, "%.3f %.3f %.3f RG\n", r, g, b);
-      pdf_content = sdscatprintf(pdf_content, "%d J\n", st.square_cap ? 2 : 1);
-      pdf_content = sdscatprintf(pdf_content, "1 j\n");
-
-      // First point
-      remfmt_seg pt0 = kv_A(st.segments, 0);
-      float x0 = pt0.x + xOffset - min_x;
-      float y0 = pt0.y - min_y;
-      if (prm && prm->landscape) {
-        float rx = (float)port_h - y0;
-        float ry = x0;
-        x0 = rx;
-        y0 = ry;
-      }
-      float yp0 = (float)height - y0;
-      pdf_content = sdscatprintf(pdf_content, "%.3f %.3f m\n", x0, yp0);
+    if (pg->landscape) {
+      float rx = (float)pg->port_h - y;
+      float ry = x;
+      x = rx;
+      y = ry;
+    }
 
-      if (num_points == 1) {
-        pdf_content = sdscatprintf(pdf_content, "%.3f %.3f l\n", x0, yp0);
-      }
+    float yp = (float)pg->height - y;
+    seg_width = get_seg_width(&st, j);
+
+    pg->content = sdscatprintf(pg->content, "%.3f %.3f l\n", x, yp);
+    if (fabsf(lsw - seg_width) > 0.08f * lsw) {
+      pg->content = sdscatprintf(pg->content, "S\n");
+      pg->content = sdscatprintf(pg->content, "%.3f w\n", seg_width);
+      pg->content = sdscatprintf(pg->content, "%.3f %.3f m\n", x, yp);
+      lsw = seg_width;
+    }
+  }
+  pg->content = sdscatprintf(pg->content, "S\nQ\n");
+  return true;
+}
 
-      for (int j = 1; j < num_points; j++) {
-        remfmt_seg sg = kv_A(st.segments, j);
-        float x = sg.x + xOffset - min_x;
-        float y = sg.y - min_y;
 
-        if (prm && prm->landscape) {
-          float rx = (float)port_h - y;
-          float ry = x;
-          x = rx;
-          y = ry;
-        }
+void remfmt_render_pdf(FILE *stream, remfmt_stroke_vec *strokes,
+                       remfmt_render_params *prm) {
+  remfmt_info info;
+  remfmt_summarize(strokes, &info);
+  float min_x, min_y;
+  int port_w, port_h;
+  remfmt_page_extent(&info.bbox, info.version, (float)DEV_W, (float)DEV_H,
+                     prm && prm->annotation, &min_x, &min_y, &port_w, &port_h);
 
-        float yp = (float)height - y;
-        seg_width = get_seg_width(&st, &sg);
+  int width = port_w;
+  int height = port_h;
+  if (prm && prm->landscape) {
+    width = port_h;
+    height = port_w;
+  }
 
-        pdf_content = sdscatprintf(pdf_content, "%.3f %.3f l\n", x, yp);
-        if (fabsf(lsw - seg_width) > 0.08f * lsw) {
-          pdf_content = sdscatprintf(pdf_content, "S\n");
-          pdf_content = sdscatprintf(pdf_content, "%.3f w\n", seg_width);
-          pdf_content = sdscatprintf(pdf_content, "%.3f %.3f m\n", x, yp);
-          lsw = seg_width;
-        }
-      }
-      pdf_content = sdscatprintf(pdf_content, "S\nQ\n");
-    }
+  pdf_page pg = {.content = sdsempty(),
+                 .min_x = min_x,
+                 .min_y = min_y,
+                 .port_h = port_h,
+                 .height = height,
+                 .landscape = prm && prm->landscape};
+  if (strokes != NULL) {
+    for (int i = 0; i < kv_size(*strokes); i++)
+      pdf_stroke(&kv_A(*strokes, i), &pg);
   }
+  sds pdf_content = pg.content;
 
   int tw = 0, th = 0;
   unsigned char *tdata = NULL;
@@ -265,6 +267,7 @@ void remfmt_render_pdf(FILE *stream, remfmt_stroke_vec *strokes,
 }
 
 void remfmt_render_notebook_pdf(FILE *stream, int num_pages,
+                                const char **rm_paths,
                                 remfmt_stroke_vec **pages_strokes,
                                 remfmt_render_params **pages_prms) {
   if (num_pages <= 0)
@@ -366,36 +369,22 @@ void remfmt_render_notebook_pdf(FILE *stream, int num_pages,
 
   // 3. Render pages
   for (int i = 0; i < num_pages; i++) {
-    remfmt_stroke_vec *strokes = pages_strokes[i];
+    const char *rm_path = rm_paths[i];
+    remfmt_stroke_vec *strokes = pages_strokes ? pages_strokes[i] : NULL;
     remfmt_render_params *prm = pages_prms[i];
 
-    float min_x = 0.0f;
-    float max_x = (float)DEV_W;
-    float min_y = 0.0f;
-    float max_y = (float)DEV_H;
-
-    if (strokes != NULL && !(prm && prm->annotation)) {
-      for (int k = 0; k < kv_size(*strokes); k++) {
-        remfmt_stroke *st = &kv_A(*strokes, k);
-        float xOffset = (st->version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-        for (int j = 0; j < kv_size(st->segments); j++) {
-          remfmt_seg sg = kv_A(st->segments, j);
-          float x = sg.x + xOffset;
-          float y = sg.y;
-          if (x < min_x)
-            min_x = x;
-          if (x > max_x)
-            max_x = x;
-          if (y < min_y)
-            min_y = y;
-          if (y > max_y)
-            max_y = y;
-        }
-      }
-    }
-
-    int port_w = (int)ceilf(max_x - min_x);
-    int port_h = (int)ceilf(max_y - min_y);
+    // Without strokes at hand, the probe sizes the page without holding
+    // them, and they are then drawn one at a time.
+    remfmt_info info;
+    if (strokes)
+      remfmt_summarize(strokes, &info);
+    else if (!rm_path || !remfmt_probe(rm_path, &info))
+      remfmt_summarize(NULL, &info);
+    float min_x, min_y;
+    int port_w, port_h;
+    remfmt_page_extent(&info.bbox, info.version, (float)DEV_W, (float)DEV_H,
+                       prm && prm->annotation, &min_x, &min_y, &port_w,
+                       &port_h);
     int width = port_w;
     int height = port_h;
     if (prm && prm->landscape) {
@@ -403,125 +392,19 @@ void remfmt_render_notebook_pdf(FILE *stream, int num_pages,
       height = port_w;
     }
 
-    sds pdf_content = sdsempty();
-    if (strokes != NULL) {
-      for (int k = 0; k < kv_size(*strokes); k++) {
-        remfmt_stroke st = kv_A(*strokes, k);
-        set_pen_attr(&st);
-
-        if (st.pen == 99) { /* PEN_IMAGE */
-          if (kv_size(st.segments) > 0) {
-            remfmt_seg first_sg = kv_A(st.segments, 0);
-            float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-            float left = first_sg.x + xOffset - min_x;
-            float top = first_sg.y - min_y;
-            float w = first_sg.width;
-            float h = first_sg.pressure;
-
-            float x_pdf = left;
-            float y_pdf = (float)height - (top + h);
-            float w_pdf = w;
-            float h_pdf = h;
-
-            if (prm && prm->landscape) {
-              x_pdf = (float)port_h - (top + h);
-              y_pdf = (float)height - (left + w);
-              w_pdf = h;
-              h_pdf = w;
-            }
-
-            pdf_content = sdscatprintf(pdf_content, "q\n");
-            pdf_content = sdscatprintf(pdf_content, "0.5 0.5 0.5 RG\n");
-            pdf_content = sdscatprintf(pdf_content, "1 w\n");
-            pdf_content = sdscatprintf(pdf_content, "%.3f %.3f %.3f %.3f re\n",
-                                       x_pdf, y_pdf, w_pdf, h_pdf);
-            pdf_content = sdscatprintf(pdf_content, "S\nQ\n");
-          }
-          continue;
-        }
-
-        int num_points = kv_size(st.segments);
-        if (num_points == 0)
-          continue;
-
-        uint32_t seg_color;
-        if (st.has_custom_color) {
-          seg_color = st.custom_color;
-        } else {
-          seg_color = (st.color < 14) ? svg_color[st.color] : 0x000000;
-        }
-
-        float r = ((seg_color >> 16) & 0xff) / 255.0f;
-        float g = ((seg_color >> 8) & 0xff) / 255.0f;
-        float b = (seg_color & 0xff) / 255.0f;
-
-        float seg_width = st.calc_width, lsw = seg_width;
-        float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-
-        float seg_alpha = get_seg_alpha(&st, &kv_A(st.segments, 0));
-        const char *gs_state = "/GS100";
-        if (st.pen == ERASER || st.pen == ERASE_AREA) {
-          gs_state = "/GS0";
-        } else {
-          if (seg_alpha < 0.15) {
-            gs_state = "/GS10";
-          } else if (seg_alpha < 0.35) {
-            gs_state = "/GS25";
-          } else if (seg_alpha < 0.95) {
-            gs_state = "/GS90";
-          }
-        }
-
-        pdf_content = sdscatprintf(pdf_content, "q\n");
-        pdf_content = sdscatprintf(pdf_content, "%s gs\n", gs_state);
-        pdf_content = sdscatprintf(pdf_content, "%.3f w\n", seg_width);
-        pdf_content = sdscatprintf(pdf_content, "%.3f %.3f %.3f RG\n", r, g, b);
-        pdf_content =
-            sdscatprintf(pdf_content, "%d J\n", st.square_cap ? 2 : 1);
-        pdf_content = sdscatprintf(pdf_content, "1 j\n");
-
-        remfmt_seg pt0 = kv_A(st.segments, 0);
-        float x0 = pt0.x + xOffset - min_x;
-        float y0 = pt0.y - min_y;
-        if (prm && prm->landscape) {
-          float rx = (float)port_h - y0;
-          float ry = x0;
-          x0 = rx;
-          y0 = ry;
-        }
-        float yp0 = (float)height - y0;
-        pdf_content = sdscatprintf(pdf_content, "%.3f %.3f m\n", x0, yp0);
-
-        if (num_points == 1) {
-          pdf_content = sdscatprintf(pdf_content, "%.3f %.3f l\n", x0, yp0);
-        }
-
-        for (int j = 1; j < num_points; j++) {
-          remfmt_seg sg = kv_A(st.segments, j);
-          float x = sg.x + xOffset - min_x;
-          float y = sg.y - min_y;
-
-          if (prm && prm->landscape) {
-            float rx = (float)port_h - y;
-            float ry = x;
-            x = rx;
-            y = ry;
-          }
-
-          float yp = (float)height - y;
-          seg_width = get_seg_width(&st, &sg);
-
-          pdf_content = sdscatprintf(pdf_content, "%.3f %.3f l\n", x, yp);
-          if (fabsf(lsw - seg_width) > 0.08f * lsw) {
-            pdf_content = sdscatprintf(pdf_content, "S\n");
-            pdf_content = sdscatprintf(pdf_content, "%.3f w\n", seg_width);
-            pdf_content = sdscatprintf(pdf_content, "%.3f %.3f m\n", x, yp);
-            lsw = seg_width;
-          }
-        }
-        pdf_content = sdscatprintf(pdf_content, "S\nQ\n");
-      }
+    pdf_page pg = {.content = sdsempty(),
+                   .min_x = min_x,
+                   .min_y = min_y,
+                   .port_h = port_h,
+                   .height = height,
+                   .landscape = prm && prm->landscape};
+    if (strokes) {
+      for (size_t j = 0; j < kv_size(*strokes); j++)
+        pdf_stroke(&kv_A(*strokes, j), &pg);
+    } else if (rm_path) {
+      remfmt_parse_each(rm_path, pdf_stroke, &pg);
     }
+    sds pdf_content = pg.content;
 
     const char *res_str =
         "/GS0 << /Type /ExtGState /ca 0.00 /CA 0.00 >> /GS25 << /Type "
@@ -6,7 +6,11 @@
 
 void remfmt_render_pdf(FILE *stream, remfmt_stroke_vec *strokes,
                        remfmt_render_params *prm);
+// Pages with strokes in pages_strokes, which may be NULL, are drawn from
+// them. The rest are read from their .rm file as they are drawn, so no more
+// than one stroke is held at a time. A NULL path gives a blank page.
 void remfmt_render_notebook_pdf(FILE *stream, int num_pages,
+                                const char **rm_paths,
                                 remfmt_stroke_vec **pages_strokes,
                                 remfmt_render_params **pages_prms);
 
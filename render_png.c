@@ -1,6 +1,7 @@
 #include "render_png.h"
 #include "template_renderer.h"
 #include <math.h>
+#include <pthread.h>
 
 typedef struct {
   float alpha;
@@ -97,7 +98,7 @@ typedef struct {
 } canvas_pixel;
 
 static uint32_t png_crc_table[256];
-static bool png_crc_table_computed = false;
+static pthread_once_t png_crc_once = PTHREAD_ONCE_INIT;
 
 static void png_make_crc_table(void) {
   for (uint32_t i = 0; i < 256; i++) {
@@ -111,13 +112,10 @@ static void png_make_crc_table(void) {
     }
     png_crc_table[i] = c;
   }
-  png_crc_table_computed = true;
 }
 
 static uint32_t png_update_crc(uint32_t crc, const uint8_t *buf, size_t len) {
-  if (!png_crc_table_computed) {
-    png_make_crc_table();
-  }
+  pthread_once(&png_crc_once, png_make_crc_table);
   uint32_t c = crc;
   for (size_t i = 0; i < len; i++) {
     c = png_crc_table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
@@ -146,6 +144,16 @@ static void custom_png_write_chunk(FILE *f, const char *type,
   fwrite(crc_buf, 1, 4, f);
 }
 
+// IDAT holds the filtered rows in stored (uncompressed) deflate blocks, so
+// the stream's length depends on the dimensions alone.
+static size_t png_stream_size(int width, int height) {
+  size_t u_size = ((size_t)width * 4 + 1) * (size_t)height;
+  size_t num_blocks = (u_size + 65534) / 65535;
+  size_t zlib_size = 2 + num_blocks * 5 + u_size + 4;
+  // Signature, then IHDR, IDAT and IEND with 12 bytes of framing each.
+  return 8 + (12 + 13) + (12 + zlib_size) + 12;
+}
+
 static void write_png_to_stream(FILE *stream, canvas_pixel *canvas, int width,
                                 int height) {
   const uint8_t png_sig[8] = {0x89, 0x50, 0x4e, 0x47, 0x0d, 0x0a, 0x1a, 0x0a};
@@ -446,39 +454,35 @@ static void draw_segment(canvas_pixel *canvas, canvas_pixel *bg_canvas,
   }
 }
 
-void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
-                       remfmt_render_params *prm) {
-  float min_x = 0.0f;
-  float max_x =
+// The page's canvas, grown to take in strokes that run past it.
+// Annotation layers keep the size of the page they go over.
+static void canvas_extent(const remfmt_info *info, remfmt_render_params *prm,
+                          float *min_x, float *min_y, int *port_w,
+                          int *port_h) {
+  float dev_w =
       (prm && prm->canvas_width > 0.0f) ? prm->canvas_width : (float)DEV_W;
-  float min_y = 0.0f;
-  float max_y =
+  float dev_h =
       (prm && prm->canvas_height > 0.0f) ? prm->canvas_height : (float)DEV_H;
+  remfmt_page_extent(&info->bbox, info->version, dev_w, dev_h,
+                     prm && prm->annotation, min_x, min_y, port_w, port_h);
+}
 
-  if (strokes != NULL && !(prm && prm->annotation)) {
-    for (int i = 0; i < kv_size(*strokes); i++) {
-      remfmt_stroke *st = &kv_A(*strokes, i);
-      float dev_w =
-          (prm && prm->canvas_width > 0.0f) ? prm->canvas_width : (float)DEV_W;
-      float xOffset = (st->version == 6) ? (dev_w / 2.0f) : 0.0f;
-      for (int j = 0; j < kv_size(st->segments); j++) {
-        remfmt_seg sg = kv_A(st->segments, j);
-        float x = sg.x + xOffset;
-        float y = sg.y;
-        if (x < min_x)
-          min_x = x;
-        if (x > max_x)
-          max_x = x;
-        if (y < min_y)
-          min_y = y;
-        if (y > max_y)
-          max_y = y;
-      }
-    }
-  }
+size_t remfmt_png_size(const remfmt_info *info, remfmt_render_params *prm) {
+  float min_x, min_y;
+  int port_w, port_h;
+  canvas_extent(info, prm, &min_x, &min_y, &port_w, &port_h);
+  if (prm && prm->landscape)
+    return png_stream_size(port_h, port_w);
+  return png_stream_size(port_w, port_h);
+}
 
-  int port_w = (int)ceilf(max_x - min_x);
-  int port_h = (int)ceilf(max_y - min_y);
+void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
+                       remfmt_render_params *prm) {
+  remfmt_info info;
+  remfmt_summarize(strokes, &info);
+  float min_x, min_y;
+  int port_w, port_h;
+  canvas_extent(&info, prm, &min_x, &min_y, &port_w, &port_h);
 
   int width = port_w;
   int height = port_h;
@@ -542,18 +546,18 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
   if (strokes != NULL) {
     for (int i = 0; i < kv_size(*strokes); i++) {
       remfmt_stroke *st = &kv_A(*strokes, i);
-      int num_points = kv_size(st->segments);
+      const remfmt_points *p = &st->points;
+      int num_points = p->n;
 
       if (st->pen == 99) { /* PEN_IMAGE */
-        if (num_points > 0 && st->image_path != NULL) {
+        if (num_points > 1 && st->image_path != NULL) {
           float dev_w_st = (prm && prm->canvas_width > 0.0f) ? prm->canvas_width
                                                              : (float)DEV_W;
           float xOffset = (st->version == 6) ? (dev_w_st / 2.0f) : 0.0f;
-          remfmt_seg sg1 = kv_A(st->segments, 0);
-          float left = sg1.x + xOffset - min_x;
-          float top = sg1.y - min_y;
-          float w = sg1.width;
-          float h = sg1.pressure;
+          float left = p->x[0] + xOffset - min_x;
+          float top = p->y[0] - min_y;
+          float w = p->x[1] - p->x[0];
+          float h = p->y[1] - p->y[0];
 
           sds full_path = sdsempty();
           if (prm && prm->asset_dir) {
@@ -671,16 +675,17 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
       if (is_hl && mask != NULL) {
         float s_min_x = 1e9f, s_max_x = -1e9f, s_min_y = 1e9f, s_max_y = -1e9f;
         for (int j = 0; j < num_points; j++) {
-          remfmt_seg sg = kv_A(st->segments, j);
-          float x = sg.x + xOffset - min_x;
-          float y = sg.y - min_y;
+          float x = p->x[j] + xOffset - min_x;
+          float y = p->y[j] - min_y;
           if (prm && prm->landscape) {
             float rx = (float)port_h - y;
             float ry = x;
             x = rx;
             y = ry;
           }
-          float r = (sg.width * st->width * bm.width_scale) / 4.0f + 2.0f;
+          float r =
+              (remfmt_point_width(p, j) * st->width * bm.width_scale) / 4.0f +
+              2.0f;
           if (x - r < s_min_x)
             s_min_x = x - r;
           if (x + r > s_max_x)
@@ -702,6 +707,9 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
         box_max_y = (int)ceilf(s_max_y) + 1;
         if (box_max_y >= height)
           box_max_y = height - 1;
+        // Wholly off the canvas, where nothing of it would be drawn.
+        if (box_min_x > box_max_x || box_min_y > box_max_y)
+          continue;
 
         for (int y = box_min_y; y <= box_max_y; y++) {
           memset(&mask[y * width + box_min_x], 0, box_max_x - box_min_x + 1);
@@ -709,16 +717,16 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
       }
 
       if (num_points == 1) {
-        remfmt_seg pt = kv_A(st->segments, 0);
-        float x = pt.x + xOffset - min_x;
-        float y = pt.y - min_y;
+        float x = p->x[0] + xOffset - min_x;
+        float y = p->y[0] - min_y;
         if (prm && prm->landscape) {
           float rx = (float)port_h - y;
           float ry = x;
           x = rx;
           y = ry;
         }
-        float w = (pt.width < 0.01f) ? st->width : pt.width;
+        float w0 = remfmt_point_width(p, 0);
+        float w = (w0 < 0.01f) ? st->width : w0;
         float r = (w * st->width * bm.width_scale) / 4.0f;
         if (r < 0.5f)
           r = 0.5f;
@@ -727,13 +735,10 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
                     r, stroke_color, bm.alpha, is_eraser);
       } else {
         for (int j = 1; j < num_points; j++) {
-          remfmt_seg prev = kv_A(st->segments, j - 1);
-          remfmt_seg curr = kv_A(st->segments, j);
-
-          float x1 = prev.x + xOffset - min_x;
-          float y1 = prev.y - min_y;
-          float x2 = curr.x + xOffset - min_x;
-          float y2 = curr.y - min_y;
+          float x1 = p->x[j - 1] + xOffset - min_x;
+          float y1 = p->y[j - 1] - min_y;
+          float x2 = p->x[j] + xOffset - min_x;
+          float y2 = p->y[j] - min_y;
 
           if (prm && prm->landscape) {
             float rx1 = (float)port_h - y1;
@@ -746,8 +751,12 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
             y2 = ry2;
           }
 
-          float w1 = (prev.width < 0.01f) ? st->width : prev.width;
-          float w2 = (curr.width < 0.01f) ? st->width : curr.width;
+          float w1 = remfmt_point_width(p, j - 1);
+          float w2 = remfmt_point_width(p, j);
+          if (w1 < 0.01f)
+            w1 = st->width;
+          if (w2 < 0.01f)
+            w2 = st->width;
           float segWidth =
               ((w1 + w2) / 2.0f) * (st->width / 2.0f) * bm.width_scale * 0.5f;
           if (segWidth < 0.4f)
@@ -800,6 +809,7 @@ void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
 
   write_png_to_stream(stream, canvas, width, height);
   free(canvas);
+  free(bg_canvas);
   if (mask)
     free(mask);
 }
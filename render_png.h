@@ -6,5 +6,8 @@
 
 void remfmt_render_png(FILE *stream, remfmt_stroke_vec *strokes,
                        remfmt_render_params *prm);
+// Exact length of what remfmt_render_png writes for strokes summarized by
+// info, worked out without rendering.
+size_t remfmt_png_size(const remfmt_info *info, remfmt_render_params *prm);
 
 #endif
@@ -0,0 +1,108 @@
+#include "render_pool.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_RENDER_THREADS 64
+
+typedef struct render_job {
+  render_fn fn;
+  void *arg;
+  cache_entry *result;
+  bool done;
+  pthread_cond_t done_cond;
+  struct render_job *next;
+} render_job;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static render_job *queue_head = NULL;
+static render_job *queue_tail = NULL;
+static pthread_t workers[MAX_RENDER_THREADS];
+static int num_workers = 0;
+static bool stopping = false;
+
+static void *render_worker(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&pool_mutex);
+  for (;;) {
+    while (!queue_head && !stopping)
+      pthread_cond_wait(&pool_cond, &pool_mutex);
+    if (!queue_head)
+      break;
+    render_job *job = queue_head;
+    queue_head = job->next;
+    if (!queue_head)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&pool_mutex);
+
+    cache_entry *result = job->fn(job->arg);
+
+    pthread_mutex_lock(&pool_mutex);
+    job->result = result;
+    job->done = true;
+    pthread_cond_signal(&job->done_cond);
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  return NULL;
+}
+
+int render_pool_start(int nthreads) {
+  if (nthreads <= 0) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = ncpu > 0 ? (int)ncpu : 1;
+  }
+  if (nthreads > MAX_RENDER_THREADS)
+    nthreads = MAX_RENDER_THREADS;
+
+  pthread_mutex_lock(&pool_mutex);
+  stopping = false;
+  while (num_workers < nthreads) {
+    if (pthread_create(&workers[num_workers], NULL, render_worker, NULL) != 0)
+      break;
+    num_workers++;
+  }
+  int started = num_workers;
+  pthread_mutex_unlock(&pool_mutex);
+  return started > 0 ? 0 : -1;
+}
+
+void render_pool_stop(void) {
+  pthread_mutex_lock(&pool_mutex);
+  stopping = true;
+  pthread_cond_broadcast(&pool_cond);
+  int n = num_workers;
+  pthread_mutex_unlock(&pool_mutex);
+
+  // Workers drain whatever is still queued before exiting.
+  for (int i = 0; i < n; i++)
+    pthread_join(workers[i], NULL);
+
+  pthread_mutex_lock(&pool_mutex);
+  num_workers = 0;
+  pthread_mutex_unlock(&pool_mutex);
+}
+
+cache_entry *render_pool_run(render_fn fn, void *arg) {
+  render_job job = {.fn = fn, .arg = arg};
+
+  pthread_mutex_lock(&pool_mutex);
+  if (num_workers == 0 || stopping) {
+    pthread_mutex_unlock(&pool_mutex);
+    return fn(arg);
+  }
+  pthread_cond_init(&job.done_cond, NULL);
+  if (queue_tail)
+    queue_tail->next = &job;
+  else
+    queue_head = &job;
+  queue_tail = &job;
+  pthread_cond_signal(&pool_cond);
+  while (!job.done)
+    pthread_cond_wait(&job.done_cond, &pool_mutex);
+  pthread_mutex_unlock(&pool_mutex);
+
+  pthread_cond_destroy(&job.done_cond);
+  return job.result;
+}
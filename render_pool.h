@@ -0,0 +1,16 @@
+#ifndef RENDER_POOL_H
+#define RENDER_POOL_H
+
+#include "cache.h"
+
+typedef cache_entry *(*render_fn)(void *arg);
+
+// Starts nthreads workers; nthreads <= 0 uses one per online CPU.
+int render_pool_start(int nthreads);
+void render_pool_stop(void);
+
+// Queues fn(arg) and blocks the calling thread until it has run. Runs fn
+// inline when the pool is not started.
+cache_entry *render_pool_run(render_fn fn, void *arg);
+
+#endif /* RENDER_POOL_H */
@@ -16,33 +16,12 @@ enum { SVG_HEADER = 0, SVG_POLYLINE = 1, SVG_FOOTER = 2 };
 void remfmt_render_svg(FILE *stream, remfmt_stroke_vec *strokes,
                        remfmt_render_params *prm) {
 
-  float min_x = 0.0f;
-  float max_x = (float)DEV_W;
-  float min_y = 0.0f;
-  float max_y = (float)DEV_H;
-
-  if (strokes != NULL && !(prm && prm->annotation)) {
-    for (int i = 0; i < kv_size(*strokes); i++) {
-      remfmt_stroke *st = &kv_A(*strokes, i);
-      float xOffset = (st->version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-      for (int j = 0; j < kv_size(st->segments); j++) {
-        remfmt_seg sg = kv_A(st->segments, j);
-        float x = sg.x + xOffset;
-        float y = sg.y;
-        if (x < min_x)
-          min_x = x;
-        if (x > max_x)
-          max_x = x;
-        if (y < min_y)
-          min_y = y;
-        if (y > max_y)
-          max_y = y;
-      }
-    }
-  }
-
-  int port_w = (int)ceilf(max_x - min_x);
-  int port_h = (int)ceilf(max_y - min_y);
+  remfmt_info info;
+  remfmt_summarize(strokes, &info);
+  float min_x, min_y;
+  int port_w, port_h;
+  remfmt_page_extent(&info.bbox, info.version, (float)DEV_W, (float)DEV_H,
+                     prm && prm->annotation, &min_x, &min_y, &port_w, &port_h);
 
   sds b64_img = sdsempty();
   if (prm && prm->template_dir && prm->template_name &&
@@ -65,16 +44,16 @@ void remfmt_render_svg(FILE *stream, remfmt_stroke_vec *strokes,
   if (strokes != NULL) {
     for (int i = 0; i < kv_size(*strokes); i++) {
       remfmt_stroke st = kv_A(*strokes, i);
+      const remfmt_points *p = &st.points;
       set_pen_attr(&st);
 
       if (st.pen == 99) { /* PEN_IMAGE */
-        if (kv_size(st.segments) > 0 && st.image_path != NULL) {
-          remfmt_seg sg1 = kv_A(st.segments, 0);
+        if (p->n > 1 && st.image_path != NULL) {
           float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
-          float x = sg1.x + xOffset - min_x;
-          float y = sg1.y - min_y;
-          float w = sg1.width;
-          float h = sg1.pressure;
+          float x = p->x[0] + xOffset - min_x;
+          float y = p->y[0] - min_y;
+          float w = p->x[1] - p->x[0];
+          float h = p->y[1] - p->y[0];
 
           float x_svg = x;
           float y_svg = y;
@@ -127,17 +106,15 @@ void remfmt_render_svg(FILE *stream, remfmt_stroke_vec *strokes,
 
       float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
 
-      if (kv_size(st.segments) > 0) {
-        remfmt_seg first_sg = kv_A(st.segments, 0);
-        lsw = get_seg_width(&st, &first_sg);
+      if (p->n > 0) {
+        lsw = get_seg_width(&st, 0);
         seg_width = lsw;
       }
 
       sds pv = sdsempty();
-      for (int j = 0; j < kv_size(st.segments); j++) {
-        remfmt_seg sg = kv_A(st.segments, j);
-        float x = sg.x + xOffset - min_x;
-        float y = sg.y - min_y;
+      for (size_t j = 0; j < p->n; j++) {
+        float x = p->x[j] + xOffset - min_x;
+        float y = p->y[j] - min_y;
 
         if (prm && prm->landscape) {
           float rx = (float)port_h - y;
@@ -146,8 +123,8 @@ void remfmt_render_svg(FILE *stream, remfmt_stroke_vec *strokes,
           y = ry;
         }
 
-        seg_width = get_seg_width(&st, &sg);
-        seg_alpha = get_seg_alpha(&st, &sg);
+        seg_width = get_seg_width(&st, j);
+        seg_alpha = get_seg_alpha(&st, j);
 
         pv = sdscatprintf(pv, fmt, x, y);
         if (fabsf(lsw - seg_width) > 0.08f * lsw) {
@@ -26,7 +26,7 @@ static void render_xoj_page(gzFile gf, remfmt_stroke_vec *strokes,
       if (st.pen == 99) { /* PEN_IMAGE */
         continue;
       }
-      if (kv_size(st.segments) == 0)
+      if (st.points.n == 0)
         continue;
 
       const char *color_str = "black";
@@ -70,10 +70,9 @@ static void render_xoj_page(gzFile gf, remfmt_stroke_vec *strokes,
 
       float xOffset = (st.version == 6) ? ((float)DEV_W / 2.0f) : 0.0f;
 
-      for (int j = 0; j < kv_size(st.segments); j++) {
-        remfmt_seg *sg = &kv_A(st.segments, j);
-        float x = sg->x + xOffset;
-        float y = sg->y;
+      for (int j = 0; j < st.points.n; j++) {
+        float x = st.points.x[j] + xOffset;
+        float y = st.points.y[j];
 
         if (prm && prm->landscape) {
           float rx = (float)DEV_H - y;
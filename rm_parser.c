@@ -1,6 +1,8 @@
 #include "rm_parser.h"
+#include "digest.h"
 #include "struct.h"
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -68,6 +70,93 @@ static double read_float64(rm_buf *b) {
   return val.d;
 }
 
+// The point decoders below fill whole runs of points straight from the
+// mapped file. Their callers check once that all n records lie within it.
+static float load_float32(const uint8_t *s) {
+  union {
+    uint32_t u;
+    float f;
+  } val;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&val.u, s, 4);
+#else
+  val.u = (uint32_t)s[0] | ((uint32_t)s[1] << 8) | ((uint32_t)s[2] << 16) |
+          ((uint32_t)s[3] << 24);
+#endif
+  return val.f;
+}
+
+// Brings f * scale to the nearest step of a packed attribute.
+static unsigned quantize(float f, float scale, unsigned max) {
+  float q = f * scale + 0.5f;
+  if (!(q > 0.0f))
+    return 0;
+  return q >= (float)max ? max : (unsigned)q;
+}
+
+static remfmt_attr pack_attr(float speed, float tilt, float width,
+                             float pressure) {
+  return (remfmt_attr){
+      .speed = quantize(speed, 1.0f, UINT16_MAX),
+      .width = quantize(width, 4.0f, UINT16_MAX),
+      .tilt = quantize(tilt, 255.0f / (3.1415926535f * 2.0f), UINT8_MAX),
+      .pressure = quantize(pressure, 255.0f, UINT8_MAX)};
+}
+
+// v3/v5 points: six floats, the attributes brought down to the precision
+// of the packed v6 ones.
+static void decode_v5_points(const uint8_t *src, size_t n, remfmt_points *p) {
+  float *x = p->x + p->n, *y = p->y + p->n;
+  remfmt_attr *attr = p->attr + p->n;
+  for (size_t i = 0; i < n; i++, src += 24) {
+    x[i] = load_float32(src);
+    y[i] = load_float32(src + 4);
+    attr[i] = pack_attr(load_float32(src + 8), load_float32(src + 12),
+                        load_float32(src + 16), load_float32(src + 20));
+  }
+  p->n += n;
+}
+
+// v6 points from version 1 line blocks are floats as well, and are packed
+// the way xochitl packs them for version 2.
+static void decode_v6_float_points(const uint8_t *src, size_t n,
+                                   remfmt_points *p) {
+  float *x = p->x + p->n, *y = p->y + p->n;
+  remfmt_attr *attr = p->attr + p->n;
+  for (size_t i = 0; i < n; i++, src += 24) {
+    x[i] = load_float32(src);
+    y[i] = load_float32(src + 4);
+    attr[i] = (remfmt_attr){
+        .speed = quantize(load_float32(src + 8), 4.0f, UINT16_MAX),
+        .width = quantize(load_float32(src + 16), 4.0f, UINT16_MAX),
+        .tilt = quantize(load_float32(src + 12),
+                         255.0f / (3.1415926535f * 2.0f), UINT8_MAX),
+        .pressure = quantize(load_float32(src + 20), 255.0f, UINT8_MAX)};
+  }
+  p->n += n;
+}
+
+// Packed v6 points, 14 bytes each: x and y as floats, then speed and width
+// as u16 and direction and pressure as u8, laid out as remfmt_attr.
+static void decode_v6_points(const uint8_t *src, size_t n, remfmt_points *p) {
+  float *x = p->x + p->n, *y = p->y + p->n;
+  remfmt_attr *attr = p->attr + p->n;
+  for (size_t i = 0; i < n; i++, src += 14) {
+    x[i] = load_float32(src);
+    y[i] = load_float32(src + 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    memcpy(&attr[i], src + 8, sizeof(remfmt_attr));
+#else
+    attr[i] = (remfmt_attr){.speed = (uint16_t)src[8] | (uint16_t)src[9] << 8,
+                            .width =
+                                (uint16_t)src[10] | (uint16_t)src[11] << 8,
+                            .tilt = src[12],
+                            .pressure = src[13]};
+#endif
+  }
+  p->n += n;
+}
+
 static uint64_t read_varuint(rm_buf *b) {
   uint64_t result = 0;
   int shift = 0;
@@ -102,113 +191,314 @@ static bool check_tag(rm_buf *b, int expectedIndex, int expectedType) {
   return (index == expectedIndex && type == expectedType);
 }
 
-static void parse_scene_line_item(rm_buf *b, uint8_t version,
-                                  remfmt_stroke_vec *strokes,
-                                  size_t block_body_pos,
-                                  uint32_t block_length) {
-  uint8_t p1;
-  uint64_t p2;
+typedef struct {
+  uint8_t part1;
+  uint64_t part2;
+} crdt_id;
+
+typedef kvec_t(crdt_id) crdt_id_vec;
+
+// Every scene item opens with its parent, item, left and right ids and a
+// deleted length, then optionally a subblock holding the item's value.
+static bool read_item_head(rm_buf *b, crdt_id *item, uint32_t *deleted) {
+  for (int i = 1; i <= 4; i++) {
+    crdt_id id;
+    if (!read_tag(b, i, TAG_TYPE_ID))
+      return false;
+    read_crdt_id(b, &id.part1, &id.part2);
+    if (i == 2)
+      *item = id;
+  }
+  if (!read_tag(b, 5, TAG_TYPE_BYTE4))
+    return false;
+  *deleted = read_uint32(b);
+  return true;
+}
 
-  if (!read_tag(b, 1, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
+static bool read_item_subblock(rm_buf *b, uint32_t *len, size_t *start) {
+  crdt_id item;
+  uint32_t deleted;
+  if (!read_item_head(b, &item, &deleted))
+    return false;
+
+  if (!check_tag(b, 6, TAG_TYPE_LENGTH4))
+    return false;
+  read_tag(b, 6, TAG_TYPE_LENGTH4);
+  *len = read_uint32(b);
+  *start = b->pos;
+  return true;
+}
 
-  if (!read_tag(b, 2, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
+typedef struct {
+  uint32_t tool_id;
+  uint32_t color_id;
+  double thickness_scale;
+  uint32_t points_len;
+} line_header;
+
+// Reads a line item up to its points, and checks they fit the subblock.
+static bool read_line_header(rm_buf *b, size_t subblock_start,
+                             uint32_t subblock_len, line_header *h) {
+  if (!read_tag(b, 1, TAG_TYPE_BYTE4))
+    return false;
+  h->tool_id = read_uint32(b);
+
+  if (!read_tag(b, 2, TAG_TYPE_BYTE4))
+    return false;
+  h->color_id = read_uint32(b);
+
+  if (!read_tag(b, 3, TAG_TYPE_BYTE8))
+    return false;
+  h->thickness_scale = read_float64(b);
+
+  if (!read_tag(b, 4, TAG_TYPE_BYTE4))
+    return false;
+  read_float32(b); // starting_length
+
+  if (!read_tag(b, 5, TAG_TYPE_LENGTH4))
+    return false;
+  h->points_len = read_uint32(b);
+  return subblock_start + subblock_len >= b->pos + h->points_len &&
+         h->points_len <= b->size - b->pos;
+}
 
-  if (!read_tag(b, 3, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
+// Upper bounds on what parsing a file yields, from a walk over its headers.
+// Line strokes are kept apart from glyph and image strokes, which is all a
+// probe needs room for.
+typedef struct {
+  size_t lines;
+  size_t line_points;
+  size_t max_line_points;
+  size_t others;
+  size_t other_points;
+  size_t images;
+  size_t chars;
+  // Set when only counting blocks appended to a parsed file: the ids of the
+  // items already parsed, and whether the new blocks do more than add items.
+  const crdt_id_vec *known;
+  bool edits;
+} parse_bounds;
+
+static const remfmt_bbox empty_bbox = {INFINITY, INFINITY, -INFINITY,
+                                       -INFINITY};
+
+static void bbox_add_point(remfmt_bbox *bb, float x, float y) {
+  if (x < bb->min_x)
+    bb->min_x = x;
+  if (x > bb->max_x)
+    bb->max_x = x;
+  if (y < bb->min_y)
+    bb->min_y = y;
+  if (y > bb->max_y)
+    bb->max_y = y;
+}
 
-  if (!read_tag(b, 4, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
+static void bbox_union(remfmt_bbox *bb, const remfmt_bbox *other) {
+  if (other->min_x < bb->min_x)
+    bb->min_x = other->min_x;
+  if (other->max_x > bb->max_x)
+    bb->max_x = other->max_x;
+  if (other->min_y < bb->min_y)
+    bb->min_y = other->min_y;
+  if (other->max_y > bb->max_y)
+    bb->max_y = other->max_y;
+}
 
-  if (!read_tag(b, 5, TAG_TYPE_BYTE4))
-    return;
-  read_uint32(b);
+static void bound_line(parse_bounds *pb, size_t points) {
+  pb->lines++;
+  pb->line_points += points;
+  if (points > pb->max_line_points)
+    pb->max_line_points = points;
+}
 
-  if (check_tag(b, 6, TAG_TYPE_LENGTH4)) {
-    read_tag(b, 6, TAG_TYPE_LENGTH4);
-    uint32_t subblock_len = read_uint32(b);
-    size_t subblock_start = b->pos;
+// One parse's strokes, points and image paths all live in a single block:
+// the stroke vector at its head, then the stroke array, the x and y arrays
+// and the packed attributes, then strings stacked down from end to next. With
+// on_stroke set, each stroke is handed over as it is pushed and its room
+// taken back, so the block need only hold the largest one.
+typedef struct {
+  remfmt_stroke_vec *strokes;
+  size_t max_points;
+  char *next;
+  char *end;
+  remfmt_stroke_fn on_stroke;
+  void *ctx;
+  bool stopped;
+  // When set, the ids of line and glyph items are collected here.
+  crdt_id_vec *items;
+} stroke_arena;
+
+static remfmt_stroke_vec *arena_alloc(size_t num_strokes, size_t num_points,
+                                      size_t chars, stroke_arena *a) {
+  size_t head = sizeof(remfmt_stroke_vec);
+  char *mem = malloc(head + num_strokes * sizeof(remfmt_stroke) +
+                     num_points * (2 * sizeof(float) + sizeof(remfmt_attr)) +
+                     chars);
+  if (!mem)
+    return NULL;
+  remfmt_stroke_vec *v = (remfmt_stroke_vec *)mem;
+  v->n = 0;
+  v->m = num_strokes;
+  v->a = (remfmt_stroke *)(mem + head);
+  float *f = (float *)(v->a + num_strokes);
+  remfmt_attr *attr = (remfmt_attr *)(f + 2 * num_points);
+  v->points = (remfmt_points){.x = f, .y = f + num_points, .attr = attr};
+  v->bbox = empty_bbox;
+  v->version = 0;
+  a->strokes = v;
+  a->max_points = num_points;
+  a->next = (char *)(attr + num_points);
+  a->end = a->next + chars;
+  a->on_stroke = NULL;
+  a->ctx = NULL;
+  a->stopped = false;
+  a->items = NULL;
+  return v;
+}
 
-    uint8_t item_type = read_uint8(b);
-    if (item_type == 0x03) { /* line item */
-      if (!read_tag(b, 1, TAG_TYPE_BYTE4))
-        goto skip_subblock;
-      uint32_t tool_id = read_uint32(b);
+static remfmt_stroke_vec *arena_new(const parse_bounds *pb, bool lines,
+                                    stroke_arena *a) {
+  return arena_alloc(pb->others + (lines ? pb->lines : 0),
+                     pb->other_points + (lines ? pb->line_points : 0),
+                     pb->chars, a);
+}
 
-      if (!read_tag(b, 2, TAG_TYPE_BYTE4))
-        goto skip_subblock;
-      uint32_t color_id = read_uint32(b);
+// Room for one stroke at a time, glyph and image strokes having two points.
+static remfmt_stroke_vec *arena_scratch(const parse_bounds *pb,
+                                        stroke_arena *a) {
+  size_t points = pb->max_line_points > 2 ? pb->max_line_points : 2;
+  return arena_alloc(1, points, pb->chars, a);
+}
 
-      if (!read_tag(b, 3, TAG_TYPE_BYTE8))
-        goto skip_subblock;
-      double thickness_scale = read_float64(b);
+// An empty run starting at point off of the page arrays.
+static remfmt_points points_at(const remfmt_points *page, size_t off) {
+  return (remfmt_points){
+      .x = page->x + off, .y = page->y + off, .attr = page->attr + off};
+}
 
-      if (!read_tag(b, 4, TAG_TYPE_BYTE4))
-        goto skip_subblock;
-      float starting_length = read_float32(b);
-      (void)starting_length;
+// Hands p the next n points of the page arrays, to be filled by push_point.
+static bool alloc_points(stroke_arena *a, remfmt_points *p, size_t n) {
+  remfmt_points *page = &a->strokes->points;
+  if (n > a->max_points - page->n)
+    return false;
+  *p = points_at(page, page->n);
+  page->n += n;
+  return true;
+}
 
-      if (!read_tag(b, 5, TAG_TYPE_LENGTH4))
-        goto skip_subblock;
-      uint32_t points_len = read_uint32(b);
+static void push_point(remfmt_points *p, remfmt_seg sg) {
+  p->x[p->n] = sg.x;
+  p->y[p->n] = sg.y;
+  p->attr[p->n] = pack_attr(sg.speed, sg.tilt, sg.width, sg.pressure);
+  p->n++;
+}
+
+static char *arena_strdup(stroke_arena *a, const char *s) {
+  size_t len = strlen(s) + 1;
+  if (len > (size_t)(a->end - a->next))
+    return NULL;
+  a->end -= len;
+  memcpy(a->end, s, len);
+  return a->end;
+}
+
+// Appends st, working out its bounds and widening the page's by them.
+static void push_stroke(stroke_arena *a, const remfmt_stroke *st) {
+  remfmt_stroke_vec *v = a->strokes;
+  if (v->n == v->m || a->stopped)
+    return;
+  remfmt_stroke *dst = &v->a[v->n++];
+  *dst = *st;
+  dst->bbox = empty_bbox;
+  for (size_t i = 0; i < dst->points.n; i++)
+    bbox_add_point(&dst->bbox, dst->points.x[i], dst->points.y[i]);
+  bbox_union(&v->bbox, &dst->bbox);
+  if (a->on_stroke) {
+    if (!a->on_stroke(dst, a->ctx))
+      a->stopped = true;
+    v->n = 0;
+    v->points.n = 0;
+  }
+}
+
+// Bytes the image paths of strokes take up.
+static size_t image_chars(const remfmt_stroke_vec *strokes) {
+  size_t chars = 0;
+  for (size_t i = 0; i < kv_size(*strokes); i++) {
+    if (kv_A(*strokes, i).image_path)
+      chars += strlen(kv_A(*strokes, i).image_path) + 1;
+  }
+  return chars;
+}
 
-      size_t points_curr = b->pos;
-      if (subblock_start + subblock_len < points_curr + points_len) {
+// Appends copies of a parse's strokes, which have their points in its page
+// arrays, to a sized to take them.
+static void arena_append(stroke_arena *a, const remfmt_stroke_vec *src) {
+  remfmt_stroke_vec *v = a->strokes;
+  const remfmt_points *from = &src->points;
+  remfmt_points to;
+  if (kv_size(*src) > v->m - v->n || !alloc_points(a, &to, from->n))
+    return;
+  memcpy(to.x, from->x, from->n * sizeof(float));
+  memcpy(to.y, from->y, from->n * sizeof(float));
+  memcpy(to.attr, from->attr, from->n * sizeof(remfmt_attr));
+  for (size_t i = 0; i < kv_size(*src); i++) {
+    remfmt_stroke st = kv_A(*src, i);
+    size_t n = st.points.n;
+    st.points = points_at(&to, st.points.x - from->x);
+    st.points.n = n;
+    if (st.image_path)
+      st.image_path = arena_strdup(a, st.image_path);
+    v->a[v->n++] = st;
+  }
+  bbox_union(&v->bbox, &src->bbox);
+}
+
+static remfmt_stroke_vec *strokes_copy(const remfmt_stroke_vec *src) {
+  stroke_arena a;
+  remfmt_stroke_vec *v =
+      arena_alloc(kv_size(*src), src->points.n, image_chars(src), &a);
+  if (v) {
+    arena_append(&a, src);
+    v->version = src->version;
+  }
+  return v;
+}
+
+static void parse_scene_line_item(rm_buf *b, uint8_t version,
+                                  stroke_arena *out, size_t block_body_pos,
+                                  uint32_t block_length) {
+  uint8_t p1;
+  uint64_t p2;
+
+  uint32_t subblock_len;
+  size_t subblock_start;
+  if (read_item_subblock(b, &subblock_len, &subblock_start)) {
+    uint8_t item_type = read_uint8(b);
+    line_header h;
+    if (item_type == 0x03) { /* line item */
+      if (!read_line_header(b, subblock_start, subblock_len, &h))
         goto skip_subblock;
-      }
 
       int point_size = (version == 1) ? 24 : 14;
-      int num_points = points_len / point_size;
+      int num_points = h.points_len / point_size;
 
       remfmt_stroke st = {0};
       st.version = 6;
-      st.pen = tool_id;
-      st.color = color_id;
-      st.width = (float)thickness_scale;
+      st.pen = h.tool_id;
+      st.color = h.color_id;
+      st.width = (float)h.thickness_scale;
       st.layer = 0;
       st.has_custom_color = false;
       st.custom_color = 0;
+      if (!alloc_points(out, &st.points, num_points))
+        goto skip_subblock;
 
-      for (int i = 0; i < num_points; i++) {
-        float x = read_float32(b);
-        float y = read_float32(b);
-
-        uint16_t speed = 0;
-        uint16_t width = 0;
-        uint8_t direction = 0;
-        uint8_t pressure = 0;
-
-        if (version == 1) {
-          float speed_f = read_float32(b);
-          speed = (uint16_t)(speed_f * 4.0f);
-          float dir_f = read_float32(b);
-          direction = (uint8_t)(255.0f * dir_f / (3.1415926535f * 2.0f));
-          float width_f = read_float32(b);
-          width = (uint16_t)(width_f * 4.0f);
-          float pressure_f = read_float32(b);
-          pressure = (uint8_t)(pressure_f * 255.0f);
-        } else {
-          speed = read_uint16(b);
-          width = read_uint16(b);
-          direction = read_uint8(b);
-          pressure = read_uint8(b);
-        }
-
-        remfmt_seg sg = {.x = x,
-                         .y = y,
-                         .speed = (float)speed,
-                         .tilt =
-                             (float)direction * (3.1415926535f * 2.0f) / 255.0f,
-                         .width = (float)width / 4.0f,
-                         .pressure = (float)pressure / 255.0f};
-
-        kv_push(remfmt_seg, st.segments, sg);
-      }
+      if (version == 1)
+        decode_v6_float_points(b->data + b->pos, num_points, &st.points);
+      else
+        decode_v6_points(b->data + b->pos, num_points, &st.points);
+      b->pos += (size_t)num_points * point_size;
 
       if (read_tag(b, 6, TAG_TYPE_ID)) {
         read_crdt_id(b, &p1, &p2);
@@ -232,7 +522,7 @@ static void parse_scene_line_item(rm_buf *b, uint8_t version,
         st.custom_color = ((uint32_t)rgb_r << 16) | ((uint32_t)g << 8) | rgb_b;
       }
 
-      kv_push(remfmt_stroke, *strokes, st);
+      push_stroke(out, &st);
     }
   skip_subblock:
     b->pos = subblock_start + subblock_len;
@@ -240,36 +530,11 @@ static void parse_scene_line_item(rm_buf *b, uint8_t version,
 }
 
 static void parse_scene_glyph_item(rm_buf *b, uint32_t version,
-                                   remfmt_stroke_vec *strokes,
-                                   size_t block_body_pos, size_t block_length) {
-  uint8_t p1 = 0;
-  uint64_t p2 = 0;
-
-  if (!read_tag(b, 1, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 2, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 3, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 4, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 5, TAG_TYPE_BYTE4))
-    return;
-  read_uint32(b); // deleted_length
-
-  if (check_tag(b, 6, TAG_TYPE_LENGTH4)) {
-    read_tag(b, 6, TAG_TYPE_LENGTH4);
-    uint32_t subblock_len = read_uint32(b);
-    size_t subblock_start = b->pos;
-
+                                   stroke_arena *out, size_t block_body_pos,
+                                   size_t block_length) {
+  uint32_t subblock_len;
+  size_t subblock_start;
+  if (read_item_subblock(b, &subblock_len, &subblock_start)) {
     uint8_t item_type = read_uint8(b);
     if (item_type == 0x01) { // glyph item
       if (!read_tag(b, 4, TAG_TYPE_BYTE4))
@@ -282,6 +547,11 @@ static void parse_scene_glyph_item(rm_buf *b, uint32_t version,
       (void)rects_len;
 
       uint64_t num_rects = read_varuint(b);
+      // Each rectangle takes 32 bytes, which bounds a corrupt count.
+      size_t block_end = block_body_pos + block_length;
+      uint64_t room = b->pos < block_end ? (block_end - b->pos) / 32 : 0;
+      if (num_rects > room)
+        num_rects = room;
 
       for (uint64_t i = 0; i < num_rects; i++) {
         double x = read_float64(b);
@@ -297,6 +567,8 @@ static void parse_scene_glyph_item(rm_buf *b, uint32_t version,
         st.layer = 0;
         st.has_custom_color = false;
         st.custom_color = 0;
+        if (!alloc_points(out, &st.points, 2))
+          goto skip_subblock;
 
         remfmt_seg sg1 = {.x = (float)x,
                           .y = (float)(y + h / 2.0),
@@ -304,7 +576,7 @@ static void parse_scene_glyph_item(rm_buf *b, uint32_t version,
                           .tilt = 0.0f,
                           .width = (float)h * 4.0f,
                           .pressure = 1.0f};
-        kv_push(remfmt_seg, st.segments, sg1);
+        push_point(&st.points, sg1);
 
         remfmt_seg sg2 = {.x = (float)(x + w),
                           .y = (float)(y + h / 2.0),
@@ -312,9 +584,9 @@ static void parse_scene_glyph_item(rm_buf *b, uint32_t version,
                           .tilt = 0.0f,
                           .width = (float)h * 4.0f,
                           .pressure = 1.0f};
-        kv_push(remfmt_seg, st.segments, sg2);
+        push_point(&st.points, sg2);
 
-        kv_push(remfmt_stroke, *strokes, st);
+        push_stroke(out, &st);
       }
     }
   skip_subblock:
@@ -329,37 +601,15 @@ typedef struct {
 typedef kvec_t(remfmt_asset_mapping) remfmt_asset_mapping_vec;
 
 static void parse_scene_path_item(rm_buf *b, uint8_t version,
-                                  remfmt_stroke_vec *strokes,
-                                  size_t block_body_pos, uint32_t block_length,
+                                  stroke_arena *out, size_t block_body_pos,
+                                  uint32_t block_length,
                                   remfmt_asset_mapping_vec *assets) {
   uint8_t p1;
   uint64_t p2;
 
-  if (!read_tag(b, 1, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 2, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 3, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 4, TAG_TYPE_ID))
-    return;
-  read_crdt_id(b, &p1, &p2);
-
-  if (!read_tag(b, 5, TAG_TYPE_BYTE4))
-    return;
-  read_uint32(b);
-
-  if (check_tag(b, 6, TAG_TYPE_LENGTH4)) {
-    read_tag(b, 6, TAG_TYPE_LENGTH4);
-    uint32_t subblock_len = read_uint32(b);
-    size_t subblock_start = b->pos;
-
+  uint32_t subblock_len;
+  size_t subblock_start;
+  if (read_item_subblock(b, &subblock_len, &subblock_start)) {
     uint8_t item_type = read_uint8(b);
     if (item_type == 0x07) { /* image item */
       uint8_t img_uuid[16];
@@ -437,20 +687,18 @@ static void parse_scene_path_item(rm_buf *b, uint8_t version,
           st.layer = 0;
           st.has_custom_color = false;
           st.custom_color = 0;
-          st.image_path = strdup(filename);
+          st.image_path = arena_strdup(out, filename);
 
-          /* store bounding box corners in segments */
-          remfmt_seg sg1 = {
-              .x = left, .y = top, .width = width, .pressure = height};
-          kv_push(remfmt_seg, st.segments, sg1);
+          /* store bounding box corners in points */
+          if (st.image_path && alloc_points(out, &st.points, 2)) {
+            remfmt_seg sg1 = {.x = left, .y = top};
+            push_point(&st.points, sg1);
 
-          remfmt_seg sg2 = {.x = left + width,
-                            .y = top + height,
-                            .width = 0.0f,
-                            .pressure = 0.0f};
-          kv_push(remfmt_seg, st.segments, sg2);
+            remfmt_seg sg2 = {.x = left + width, .y = top + height};
+            push_point(&st.points, sg2);
 
-          kv_push(remfmt_stroke, *strokes, st);
+            push_stroke(out, &st);
+          }
         }
       }
     }
@@ -458,17 +706,168 @@ static void parse_scene_path_item(rm_buf *b, uint8_t version,
   }
 }
 
-static remfmt_stroke_vec *remfmt_parse_v6(rm_buf *b) {
-  remfmt_stroke_vec *strokes = calloc(1, sizeof(remfmt_stroke_vec));
-  if (strokes == NULL)
-    return NULL;
+// Maps the uuids image items refer to onto the file names of the images.
+static void parse_image_info(rm_buf *b, remfmt_asset_mapping_vec *assets) {
+  if (check_tag(b, 1, TAG_TYPE_LENGTH4)) {
+    read_tag(b, 1, TAG_TYPE_LENGTH4);
+    uint32_t subblock_len = read_uint32(b);
+    size_t subblock_start = b->pos;
+
+    uint64_t num_images = read_varuint(b);
+    for (uint64_t i = 0; i < num_images; i++) {
+      if (check_tag(b, 0, TAG_TYPE_LENGTH4)) {
+        read_tag(b, 0, TAG_TYPE_LENGTH4);
+        uint32_t entry_len = read_uint32(b);
+        size_t entry_start = b->pos;
 
+        uint8_t uuid[16];
+        for (int j = 0; j < 16; j++) {
+          uuid[j] = read_uint8(b);
+        }
+
+        char *filename = NULL;
+
+        /* read LWW string index 1 (filename) */
+        if (check_tag(b, 1, TAG_TYPE_LENGTH4)) {
+          read_tag(b, 1, TAG_TYPE_LENGTH4);
+          uint32_t lww_len = read_uint32(b);
+          size_t lww_start = b->pos;
+
+          uint8_t p1;
+          uint64_t p2;
+          if (read_tag(b, 1, TAG_TYPE_ID)) {
+            read_crdt_id(b, &p1, &p2);
+          }
+          if (check_tag(b, 2, TAG_TYPE_LENGTH4)) {
+            read_tag(b, 2, TAG_TYPE_LENGTH4);
+            uint32_t str_len = read_uint32(b);
+            size_t str_start = b->pos;
+
+            uint64_t string_length = read_varuint(b);
+            uint8_t is_ascii = read_uint8(b);
+            (void)is_ascii;
+
+            filename = malloc(string_length + 1);
+            for (uint64_t s = 0; s < string_length; s++) {
+              filename[s] = (char)read_uint8(b);
+            }
+            filename[string_length] = '\0';
+
+            b->pos = str_start + str_len;
+          }
+          b->pos = lww_start + lww_len;
+        }
+
+        if (filename != NULL) {
+          remfmt_asset_mapping map;
+          memcpy(map.uuid, uuid, 16);
+          map.filename = filename;
+          kv_push(remfmt_asset_mapping, *assets, map);
+        }
+
+        b->pos = entry_start + entry_len;
+      }
+    }
+    b->pos = subblock_start + subblock_len;
+  }
+}
+
+static void info_reset(remfmt_info *info) {
+  *info = (remfmt_info){.bbox = empty_bbox};
+}
+
+static void add_stroke(remfmt_info *info, const remfmt_stroke *st) {
+  info->num_strokes++;
+  info->pens |= REMFMT_PEN_BIT(st->pen);
+  bbox_union(&info->bbox, &st->bbox);
+}
+
+// Counts a line item and takes in its coordinates, skipping the rest of
+// each point.
+static void probe_line_item(rm_buf *b, uint8_t version, remfmt_info *info) {
+  uint32_t subblock_len;
+  size_t subblock_start;
+  line_header h;
+  if (!read_item_subblock(b, &subblock_len, &subblock_start) ||
+      read_uint8(b) != 0x03 ||
+      !read_line_header(b, subblock_start, subblock_len, &h))
+    return;
+  int point_size = (version == 1) ? 24 : 14;
+  int num_points = h.points_len / point_size;
+  const uint8_t *points = b->data + b->pos;
+  for (int i = 0; i < num_points; i++, points += point_size)
+    bbox_add_point(&info->bbox, load_float32(points),
+                   load_float32(points + 4));
+  b->pos += (size_t)num_points * point_size;
+  info->num_strokes++;
+  info->pens |= REMFMT_PEN_BIT(h.tool_id);
+}
+
+// Counts a scene item towards pb without parsing it.
+static void bound_item(rm_buf *b, uint8_t version, uint8_t block_type,
+                       uint32_t block_length, parse_bounds *pb) {
+  if (block_type == 0x05) {
+    uint32_t subblock_len;
+    size_t subblock_start;
+    line_header h;
+    if (read_item_subblock(b, &subblock_len, &subblock_start) &&
+        read_uint8(b) == 0x03 &&
+        read_line_header(b, subblock_start, subblock_len, &h)) {
+      bound_line(pb, h.points_len / ((version == 1) ? 24 : 14));
+    }
+  } else if (block_type == 0x03) {
+    pb->others += block_length / 32;
+    pb->other_points += block_length / 32 * 2;
+  } else if (block_type == 0x0F) {
+    pb->others++;
+    pb->other_points += 2;
+    pb->images++;
+  }
+}
+
+static int cmp_crdt_id(const void *a, const void *b) {
+  const crdt_id *x = a, *y = b;
+  if (x->part1 != y->part1)
+    return x->part1 < y->part1 ? -1 : 1;
+  return x->part2 < y->part2 ? -1 : x->part2 > y->part2;
+}
+
+// known is sorted by cmp_crdt_id, as parse_v6 stores it.
+static bool known_item(const crdt_id_vec *known, const crdt_id *id) {
+  return kv_size(*known) && bsearch(id, known->a, kv_size(*known),
+                                    sizeof(crdt_id), cmp_crdt_id) != NULL;
+}
+
+// Collects the id of the line or glyph item at b into out->items or, when
+// resuming, flags it in pb unless it is a new item. Deleting or changing an
+// item writes it again under the same id; a new item's deleted length only
+// concerns itself, and is ignored as the parser ignores it.
+static void note_item(const rm_buf *b, stroke_arena *out, parse_bounds *pb) {
+  if (!(pb && pb->known) && !(out && out->items))
+    return;
+  rm_buf head = *b;
+  crdt_id id;
+  uint32_t deleted;
+  bool ok = read_item_head(&head, &id, &deleted);
+  if (pb && pb->known) {
+    if (!ok || known_item(pb->known, &id))
+      pb->edits = true;
+  } else if (out && out->items && ok) {
+    kv_push(crdt_id, *out->items, id);
+  }
+}
+
+// Walks the block table from start, parsing the items into out. With info
+// set, line items are only summarized into it, not decoded; with pb set,
+// nothing is parsed and the items are only counted.
+static void walk_v6(rm_buf *b, size_t start, stroke_arena *out,
+                    remfmt_info *info, parse_bounds *pb) {
   remfmt_asset_mapping_vec assets;
   kv_init(assets);
 
-  b->pos = 43;
+  b->pos = start;
 
-  while (b->pos < b->size) {
+  while (b->pos < b->size && !(out && out->stopped)) {
     if (b->pos + 4 > b->size)
       break;
     uint32_t block_length = read_uint32(b);
@@ -484,229 +883,448 @@ static remfmt_stroke_vec *remfmt_parse_v6(rm_buf *b) {
 
     size_t block_body_pos = b->pos;
 
-    if (block_type == 0x05) { /* BlockTypeSceneLineItem */
-      parse_scene_line_item(b, current_version, strokes, block_body_pos,
+    if (block_type == 0x03 || block_type == 0x05) {
+      note_item(b, out, pb);
+    } else if (pb && pb->known &&
+               (block_type == 0x04 || block_type == 0x06 ||
+                block_type == 0x08 || block_type == 0x0F)) {
+      // Groups, text, tombstones and images: nothing to append to.
+      pb->edits = true;
+    }
+
+    if (block_type == 0x0E) { /* SceneImageInfoBlock */
+      parse_image_info(b, &assets);
+    } else if (pb) {
+      bound_item(b, current_version, block_type, block_length, pb);
+    } else if (block_type == 0x05 && info) {
+      probe_line_item(b, current_version, info);
+    } else if (block_type == 0x05) { /* BlockTypeSceneLineItem */
+      parse_scene_line_item(b, current_version, out, block_body_pos,
                             block_length);
     } else if (block_type == 0x03) { /* BlockTypeSceneGlyphItem */
-      parse_scene_glyph_item(b, current_version, strokes, block_body_pos,
+      parse_scene_glyph_item(b, current_version, out, block_body_pos,
                              block_length);
     } else if (block_type == 0x0F) { /* BlockTypeScenePathItem */
-      parse_scene_path_item(b, current_version, strokes, block_body_pos,
+      parse_scene_path_item(b, current_version, out, block_body_pos,
                             block_length, &assets);
-    } else if (block_type == 0x0E) { /* SceneImageInfoBlock */
-      if (check_tag(b, 1, TAG_TYPE_LENGTH4)) {
-        read_tag(b, 1, TAG_TYPE_LENGTH4);
-        uint32_t subblock_len = read_uint32(b);
-        size_t subblock_start = b->pos;
-
-        uint64_t num_images = read_varuint(b);
-        for (uint64_t i = 0; i < num_images; i++) {
-          if (check_tag(b, 0, TAG_TYPE_LENGTH4)) {
-            read_tag(b, 0, TAG_TYPE_LENGTH4);
-            uint32_t entry_len = read_uint32(b);
-            size_t entry_start = b->pos;
-
-            uint8_t uuid[16];
-            for (int j = 0; j < 16; j++) {
-              uuid[j] = read_uint8(b);
-            }
-
-            char *filename = NULL;
-
-            /* read LWW string index 1 (filename) */
-            if (check_tag(b, 1, TAG_TYPE_LENGTH4)) {
-              read_tag(b, 1, TAG_TYPE_LENGTH4);
-              uint32_t lww_len = read_uint32(b);
-              size_t lww_start = b->pos;
-
-              uint8_t p1;
-              uint64_t p2;
-              if (read_tag(b, 1, TAG_TYPE_ID)) {
-                read_crdt_id(b, &p1, &p2);
-              }
-              if (check_tag(b, 2, TAG_TYPE_LENGTH4)) {
-                read_tag(b, 2, TAG_TYPE_LENGTH4);
-                uint32_t str_len = read_uint32(b);
-                size_t str_start = b->pos;
-
-                uint64_t string_length = read_varuint(b);
-                uint8_t is_ascii = read_uint8(b);
-                (void)is_ascii;
-
-                filename = malloc(string_length + 1);
-                for (uint64_t s = 0; s < string_length; s++) {
-                  filename[s] = (char)read_uint8(b);
-                }
-                filename[string_length] = '\0';
-
-                b->pos = str_start + str_len;
-              }
-              b->pos = lww_start + lww_len;
-            }
-
-            if (filename != NULL) {
-              remfmt_asset_mapping map;
-              memcpy(map.uuid, uuid, 16);
-              map.filename = filename;
-              kv_push(remfmt_asset_mapping, assets, map);
-            }
-
-            b->pos = entry_start + entry_len;
-          }
-        }
-        b->pos = subblock_start + subblock_len;
-      }
     }
 
     b->pos = block_body_pos + block_length;
   }
 
   /* clean up assets */
+  size_t longest = 0;
   for (int i = 0; i < kv_size(assets); i++) {
+    size_t len = strlen(kv_A(assets, i).filename);
+    if (len > longest)
+      longest = len;
     free(kv_A(assets, i).filename);
   }
   kv_destroy(assets);
+  if (pb)
+    pb->chars = pb->images * (longest + 1);
+}
 
-  return strokes;
+// Walks the layers of a v3/v5 file, parsing the strokes into out, only
+// summarizing them into info, or with pb set only counting them. Returns
+// false if the file has no layers.
+static bool walk_v5(rm_buf *b, int version, stroke_arena *out,
+                    remfmt_info *info, parse_bounds *pb) {
+  size_t header = version == 3 ? 20 : 24;
+  b->pos = 43;
+  if (b->pos + 4 > b->size)
+    return false;
+  int num_layers = 0;
+  struct_unpack(b->data + b->pos, "<I", &num_layers);
+  b->pos += 4;
+  if (num_layers < 1)
+    return false;
+
+  for (int l = 0; l < num_layers; l++) {
+    int num_strokes = 0;
+
+    if (b->pos + 4 > b->size)
+      break;
+    struct_unpack(b->data + b->pos, "<I", &num_strokes);
+    b->pos += 4;
+
+    for (int i = 0; i < num_strokes && !(out && out->stopped); i++) {
+      int num_segments = 0;
+      remfmt_stroke st = {0};
+      st.version = version;
+      st.layer = l;
+      if (b->pos + header > b->size)
+        return true;
+      if (version == 3)
+        struct_unpack(b->data + b->pos, "<IIffI", &st.pen, &st.color,
+                      &st.unk1, &st.width, &num_segments);
+      else
+        struct_unpack(b->data + b->pos, "<IIfffI", &st.pen, &st.color,
+                      &st.unk1, &st.width, &st.unk2, &num_segments);
+      b->pos += header;
+
+      // A stroke whose segments run past the end is dropped, and ends the
+      // file.
+      size_t n = num_segments > 0 ? (size_t)num_segments : 0;
+      if (n > (b->size - b->pos) / 24)
+        return true;
+      const uint8_t *segments = b->data + b->pos;
+      b->pos += n * 24;
+
+      if (pb) {
+        bound_line(pb, n);
+      } else if (info) {
+        for (size_t j = 0; j < n; j++)
+          bbox_add_point(&info->bbox, load_float32(segments + j * 24),
+                         load_float32(segments + j * 24 + 4));
+        info->num_strokes++;
+        info->pens |= REMFMT_PEN_BIT(st.pen);
+      } else if (alloc_points(out, &st.points, n)) {
+        decode_v5_points(segments, n, &st.points);
+        push_stroke(out, &st);
+      }
+    }
+  }
+  return true;
 }
 
-remfmt_stroke_vec *remfmt_parse(const char *path) {
+// Maps a .lines file and reads the version from its header. Returns NULL if
+// there is no such header.
+static const uint8_t *map_rm(const char *path, size_t *size, int *version) {
   int fd = open(path, O_RDONLY);
   if (fd < 0)
     return NULL;
 
   struct stat st;
-  if (fstat(fd, &st) < 0) {
-    close(fd);
-    return NULL;
-  }
-
-  size_t size = st.st_size;
-  if (size < 43) {
+  if (fstat(fd, &st) < 0 || st.st_size < 43) {
     close(fd);
     return NULL;
   }
 
-  const uint8_t *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  *size = st.st_size;
+  const uint8_t *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
   close(fd);
   if (data == MAP_FAILED)
     return NULL;
 
-  rm_buf b = {.data = data, .size = size, .pos = 0};
-
   char magic[64] = {0};
-  memcpy(magic, b.data, 43);
-  int version = 0, num_layers = 0;
-  if (sscanf(magic, rmv_magic, &version) == 0) {
-    munmap((void *)data, size);
+  memcpy(magic, data, 43);
+  *version = 0;
+  if (sscanf(magic, rmv_magic, version) == 0) {
+    munmap((void *)data, *size);
     return NULL;
   }
+  return data;
+}
 
-  if (version == 6) {
-    remfmt_stroke_vec *strokes = remfmt_parse_v6(&b);
-    munmap((void *)data, size);
-    return strokes;
+// The last parses of v6 pages by path, so that a page xochitl keeps
+// appending blocks to is not decoded again from the start. Most pages are
+// parsed once and never grow, so a slot at first only notes the size a page
+// was parsed at. Only once the page has grown past it does the slot take a
+// digest of the file as parsed, the sorted ids of its line and glyph items
+// and a copy of its strokes; those bytes are held within
+// remfmt_resume_max_bytes.
+#define RESUME_SLOTS 16
+
+typedef struct {
+  char *path;
+  size_t size;
+  uint64_t digest;
+  crdt_id_vec items;
+  remfmt_stroke_vec *strokes;
+  size_t bytes;
+  uint64_t used;
+} resume_slot;
+
+size_t remfmt_resume_max_bytes = (size_t)16 * 1024 * 1024;
+unsigned long remfmt_resumed_parses;
+
+static resume_slot resume_slots[RESUME_SLOTS];
+static size_t resume_bytes;
+static uint64_t resume_clock;
+static pthread_mutex_t resume_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void resume_slot_free(resume_slot *slot) {
+  free(slot->path);
+  kv_destroy(slot->items);
+  if (slot->strokes)
+    remfmt_stroke_cleanup(slot->strokes);
+  memset(slot, 0, sizeof(*slot));
+}
+
+// Empties slot i of the table; the caller frees what it held.
+static resume_slot resume_unlink(int i) {
+  resume_slot slot = resume_slots[i];
+  resume_bytes -= slot.bytes;
+  memset(&resume_slots[i], 0, sizeof(resume_slot));
+  return slot;
+}
+
+// Moves the slot for path, if any, out of the table into slot.
+static bool resume_take(const char *path, resume_slot *slot) {
+  bool found = false;
+  pthread_mutex_lock(&resume_mutex);
+  for (int i = 0; i < RESUME_SLOTS && !found; i++) {
+    if (resume_slots[i].path && strcmp(resume_slots[i].path, path) == 0) {
+      *slot = resume_unlink(i);
+      found = true;
+    }
   }
+  pthread_mutex_unlock(&resume_mutex);
+  return found;
+}
 
-  if (version != 3 && version != 5) {
-    munmap((void *)data, size);
-    return NULL;
+// The slot to store path in: its own, an empty one, or else the least
+// recently stored of those holding no strokes, then of all.
+static int resume_victim(const char *path) {
+  int victim = -1;
+  for (int i = 0; i < RESUME_SLOTS; i++) {
+    const resume_slot *s = &resume_slots[i];
+    if (!s->path || strcmp(s->path, path) == 0)
+      return i;
+    if (victim < 0 || (!s->strokes && resume_slots[victim].strokes) ||
+        (!s->strokes == !resume_slots[victim].strokes &&
+         s->used < resume_slots[victim].used))
+      victim = i;
   }
+  return victim;
+}
 
-  b.pos = 43;
-  if (b.pos + 4 > b.size) {
-    munmap((void *)data, size);
-    return NULL;
+// Stores slot, then drops the least recently stored slots holding strokes
+// until those left fit in remfmt_resume_max_bytes. The caller sees to it
+// that slot fits on its own.
+static void resume_put(resume_slot *slot) {
+  resume_slot old[RESUME_SLOTS];
+  int n = 0;
+  pthread_mutex_lock(&resume_mutex);
+  int i = resume_victim(slot->path);
+  old[n++] = resume_unlink(i);
+  slot->used = ++resume_clock;
+  resume_slots[i] = *slot;
+  resume_bytes += slot->bytes;
+  while (resume_bytes > remfmt_resume_max_bytes) {
+    int victim = -1;
+    for (int j = 0; j < RESUME_SLOTS; j++) {
+      if (j != i && resume_slots[j].strokes &&
+          (victim < 0 || resume_slots[j].used < resume_slots[victim].used))
+        victim = j;
+    }
+    old[n++] = resume_unlink(victim);
   }
-  struct_unpack(b.data + b.pos, "<I", &num_layers);
-  b.pos += 4;
+  pthread_mutex_unlock(&resume_mutex);
+  while (n > 0)
+    resume_slot_free(&old[--n]);
+}
+
+size_t remfmt_resume_size(void) {
+  pthread_mutex_lock(&resume_mutex);
+  size_t bytes = resume_bytes;
+  pthread_mutex_unlock(&resume_mutex);
+  return bytes;
+}
+
+void remfmt_resume_cleanup(void) {
+  pthread_mutex_lock(&resume_mutex);
+  for (int i = 0; i < RESUME_SLOTS; i++)
+    resume_slot_free(&resume_slots[i]);
+  resume_bytes = 0;
+  pthread_mutex_unlock(&resume_mutex);
+}
 
-  if (num_layers < 1) {
-    munmap((void *)data, size);
+// Decodes only the blocks appended to prev's file, on top of its strokes,
+// and gathers the ids of all the items into items. Returns NULL if b does
+// not start with that file or its new blocks do more than add line and
+// glyph items.
+static remfmt_stroke_vec *resume_v6(rm_buf *b, const resume_slot *prev,
+                                    crdt_id_vec *items) {
+  if (!prev->strokes || prev->size > b->size ||
+      digest_bytes(b->data, prev->size) != prev->digest)
+    return NULL;
+  parse_bounds pb = {.known = &prev->items};
+  walk_v6(b, prev->size, NULL, NULL, &pb);
+  if (pb.edits)
     return NULL;
-  }
 
-  remfmt_stroke_vec *strokes = calloc(1, sizeof(remfmt_stroke_vec));
-  if (strokes == NULL) {
-    munmap((void *)data, size);
+  stroke_arena out;
+  const remfmt_stroke_vec *old = prev->strokes;
+  remfmt_stroke_vec *strokes =
+      arena_alloc(kv_size(*old) + pb.others + pb.lines,
+                  old->points.n + pb.other_points + pb.line_points,
+                  image_chars(old) + pb.chars, &out);
+  if (!strokes)
     return NULL;
+  arena_append(&out, old);
+  kv_copy(crdt_id, *items, prev->items);
+  out.items = items;
+  walk_v6(b, prev->size, &out, NULL, NULL);
+  __atomic_add_fetch(&remfmt_resumed_parses, 1, __ATOMIC_RELAXED);
+  return strokes;
+}
+
+static remfmt_stroke_vec *parse_v6(const char *path, rm_buf *b) {
+  resume_slot prev;
+  bool seen = resume_take(path, &prev);
+  // Pages that grew since they were last parsed are likely to grow again.
+  bool keep = seen && remfmt_resume_max_bytes > 0 &&
+              (prev.strokes || b->size > prev.size);
+  crdt_id_vec items;
+  kv_init(items);
+  remfmt_stroke_vec *strokes = seen ? resume_v6(b, &prev, &items) : NULL;
+  if (seen)
+    resume_slot_free(&prev);
+
+  if (!strokes) {
+    // A first walk over the headers sizes the arena the second one fills.
+    parse_bounds pb = {0};
+    stroke_arena out;
+    kv_size(items) = 0;
+    walk_v6(b, 43, NULL, NULL, &pb);
+    strokes = arena_new(&pb, true, &out);
+    if (strokes) {
+      out.items = keep ? &items : NULL;
+      walk_v6(b, 43, &out, NULL, NULL);
+    }
   }
 
-  bool read_error = false;
-  for (int l = 0; l < num_layers; l++) {
-    if (read_error)
-      break;
-    int num_strokes = 0;
+  // Only a file that ends on a block boundary can be picked up again.
+  if (!strokes || b->pos != b->size) {
+    kv_destroy(items);
+    return strokes;
+  }
+  strokes->version = 6;
+  resume_slot next = {.path = strdup(path), .size = b->size};
+  if (keep) {
+    next.digest = digest_bytes(b->data, b->size);
+    qsort(items.a, kv_size(items), sizeof(crdt_id), cmp_crdt_id);
+    next.items = items;
+    next.strokes = strokes_copy(strokes);
+    if (next.strokes)
+      next.bytes = remfmt_stroke_size(next.strokes) +
+                   kv_max(items) * sizeof(crdt_id);
+  } else {
+    kv_destroy(items);
+  }
+  if (!next.strokes || next.bytes > remfmt_resume_max_bytes) {
+    // What does not fit is let go, and only the size noted.
+    char *kept_path = next.path;
+    next.path = NULL;
+    resume_slot_free(&next);
+    next = (resume_slot){.path = kept_path, .size = b->size};
+  }
+  if (next.path)
+    resume_put(&next);
+  return strokes;
+}
 
-    if (b.pos + 4 > b.size)
-      break;
-    struct_unpack(b.data + b.pos, "<I", &num_strokes);
-    b.pos += 4;
+remfmt_stroke_vec *remfmt_parse(const char *path) {
+  size_t size;
+  int version;
+  const uint8_t *data = map_rm(path, &size, &version);
+  if (!data)
+    return NULL;
 
-    for (int i = 0; i < num_strokes; i++) {
-      int num_segments = 0;
-      remfmt_stroke st = {0};
-      st.version = version;
-      st.has_custom_color = false;
-      st.custom_color = 0;
-      switch (version) {
-      case 3:
-        if (b.pos + 20 > b.size) {
-          read_error = true;
-          break;
-        }
-        struct_unpack(b.data + b.pos, "<IIffI", &st.pen, &st.color, &st.unk1,
-                      &st.width, &num_segments);
-        b.pos += 20;
-        break;
-      case 5:
-        if (b.pos + 24 > b.size) {
-          read_error = true;
-          break;
-        }
-        struct_unpack(b.data + b.pos, "<IIfffI", &st.pen, &st.color, &st.unk1,
-                      &st.width, &st.unk2, &num_segments);
-        b.pos += 24;
-        break;
-      }
-      if (read_error)
-        break;
-      st.layer = l;
-      for (int j = 0; j < num_segments; j++) {
-        remfmt_seg sg = {0};
-        if (b.pos + 24 > b.size) {
-          read_error = true;
-          break;
-        }
-        struct_unpack(b.data + b.pos, "<ffffff", &sg.x, &sg.y, &sg.speed,
-                      &sg.tilt, &sg.width, &sg.pressure);
-        b.pos += 24;
-        kv_push(remfmt_seg, st.segments, sg);
-      }
-      if (read_error) {
-        if (kv_size(st.segments) > 0)
-          kv_destroy(st.segments);
-        break;
-      }
-      kv_push(remfmt_stroke, *strokes, st);
-    }
+  rm_buf b = {.data = data, .size = size, .pos = 0};
+  parse_bounds pb = {0};
+  stroke_arena out;
+  remfmt_stroke_vec *strokes = NULL;
+  if (version == 6) {
+    strokes = parse_v6(path, &b);
+  } else if ((version == 3 || version == 5) &&
+             walk_v5(&b, version, NULL, NULL, &pb)) {
+    strokes = arena_new(&pb, true, &out);
+    if (strokes)
+      walk_v5(&b, version, &out, NULL, NULL);
   }
+  if (strokes)
+    strokes->version = version;
 
   munmap((void *)data, size);
   return strokes;
 }
 
+bool remfmt_parse_each(const char *path, remfmt_stroke_fn on_stroke,
+                       void *ctx) {
+  size_t size;
+  int version;
+  const uint8_t *data = map_rm(path, &size, &version);
+  if (!data)
+    return false;
+
+  rm_buf b = {.data = data, .size = size, .pos = 0};
+  parse_bounds pb = {0};
+  stroke_arena out;
+  remfmt_stroke_vec *scratch = NULL;
+  if (version == 6) {
+    walk_v6(&b, 43, NULL, NULL, &pb);
+    scratch = arena_scratch(&pb, &out);
+  } else if ((version == 3 || version == 5) &&
+             walk_v5(&b, version, NULL, NULL, &pb)) {
+    scratch = arena_scratch(&pb, &out);
+  }
+  if (scratch) {
+    scratch->version = version;
+    out.on_stroke = on_stroke;
+    out.ctx = ctx;
+    if (version == 6)
+      walk_v6(&b, 43, &out, NULL, NULL);
+    else
+      walk_v5(&b, version, &out, NULL, NULL);
+    remfmt_stroke_cleanup(scratch);
+  }
+
+  munmap((void *)data, size);
+  return scratch != NULL;
+}
+
 void remfmt_stroke_cleanup(remfmt_stroke_vec *strokes) {
-  if (strokes == NULL)
+  // The strokes, their points and image paths share one allocation.
+  free(strokes);
+}
+
+size_t remfmt_stroke_size(const remfmt_stroke_vec *strokes) {
+  return sizeof(remfmt_stroke_vec) + strokes->m * sizeof(remfmt_stroke) +
+         strokes->points.n * (2 * sizeof(float) + sizeof(remfmt_attr)) +
+         image_chars(strokes);
+}
+
+void remfmt_summarize(remfmt_stroke_vec *strokes, remfmt_info *info) {
+  info_reset(info);
+  if (!strokes)
     return;
-  for (int i = 0; i < kv_size(*strokes); i++) {
-    remfmt_stroke st = kv_A(*strokes, i);
-    if (kv_size(st.segments) > 0)
-      kv_destroy(st.segments);
-    if (st.image_path != NULL) {
-      free(st.image_path);
+  info->version = strokes->version;
+  for (size_t i = 0; i < kv_size(*strokes); i++)
+    info->pens |= REMFMT_PEN_BIT(kv_A(*strokes, i).pen);
+  info->num_strokes = kv_size(*strokes);
+  info->bbox = strokes->bbox;
+}
+
+bool remfmt_probe(const char *path, remfmt_info *info) {
+  info_reset(info);
+  size_t size;
+  int version;
+  const uint8_t *data = map_rm(path, &size, &version);
+  if (!data)
+    return false;
+
+  rm_buf b = {.data = data, .size = size, .pos = 0};
+  info->version = version;
+  bool ok = false;
+  if (version == 6) {
+    // Glyph and image items are parsed, into an arena with no room for
+    // line strokes.
+    parse_bounds pb = {0};
+    stroke_arena others;
+    walk_v6(&b, 43, NULL, NULL, &pb);
+    if (arena_new(&pb, false, &others)) {
+      walk_v6(&b, 43, &others, info, NULL);
+      for (size_t i = 0; i < kv_size(*others.strokes); i++)
+        add_stroke(info, &kv_A(*others.strokes, i));
+      remfmt_stroke_cleanup(others.strokes);
+      ok = true;
     }
+  } else if (version == 3 || version == 5) {
+    ok = walk_v5(&b, version, NULL, info, NULL);
   }
-  kv_destroy(*strokes);
-  free(strokes);
+  munmap((void *)data, size);
+  return ok;
 }
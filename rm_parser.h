@@ -4,7 +4,39 @@
 #include "remfmt.h"
 #include <stdio.h>
 
+// The strokes come back in one allocation with their points and image
+// paths, all sized to fit: read them freely, but push nothing onto them.
+// remfmt_stroke_cleanup frees the lot. The last few v6 pages parsed are
+// remembered, and one that keeps having line and glyph items appended is
+// decoded from where its last parse ended.
 void remfmt_stroke_cleanup(remfmt_stroke_vec *strokes);
 remfmt_stroke_vec *remfmt_parse(const char *path);
+// Bytes held by what remfmt_parse returned.
+size_t remfmt_stroke_size(const remfmt_stroke_vec *strokes);
+// The most remfmt_parse keeps of growing pages to resume them from; 0
+// disables resuming. The bytes it holds, and a count of the parses that
+// resumed. remfmt_resume_cleanup lets go of every page it kept.
+extern size_t remfmt_resume_max_bytes;
+extern unsigned long remfmt_resumed_parses;
+size_t remfmt_resume_size(void);
+void remfmt_resume_cleanup(void);
+
+// Called with each stroke in the order remfmt_parse would list them. The
+// stroke, its points and its image path only last until the call returns.
+// Returning false ends the parse.
+typedef bool (*remfmt_stroke_fn)(const remfmt_stroke *st, void *ctx);
+// Parses path one stroke at a time into a buffer sized for the largest,
+// rather than holding the whole page. Returns false where remfmt_parse
+// would return NULL.
+bool remfmt_parse_each(const char *path, remfmt_stroke_fn on_stroke,
+                       void *ctx);
+
+// What remfmt_parse would find in path, read from the stroke and block
+// headers and the point coordinates, without decoding whole points.
+// Returns false where remfmt_parse would return NULL.
+bool remfmt_probe(const char *path, remfmt_info *info);
+// The same summary taken from parsed strokes, which may be NULL, in which
+// case the version is 0.
+void remfmt_summarize(remfmt_stroke_vec *strokes, remfmt_info *info);
 
 #endif
@@ -0,0 +1,152 @@
+#include "strpool.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define MIN_SLOTS 1024
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t used;
+  size_t size;
+  char data[];
+} chunk;
+
+typedef struct {
+  const char *str;
+  uint32_t hash;
+  uint32_t len;
+} slot;
+
+// Strings are bump-allocated from chunks that are never moved or freed
+// while the pool lives, and found again through an open-addressing table
+// kept at most half full.
+struct strpool {
+  chunk *chunks;
+  slot *slots;
+  size_t num_slots;
+  size_t count;
+  int refcount;
+  pthread_mutex_t mutex;
+};
+
+static uint32_t str_hash(const char *s, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  return h;
+}
+
+strpool *strpool_new(void) {
+  strpool *pool = calloc(1, sizeof(strpool));
+  if (!pool)
+    return NULL;
+  pool->refcount = 1;
+  pthread_mutex_init(&pool->mutex, NULL);
+  return pool;
+}
+
+strpool *strpool_ref(strpool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->refcount++;
+  pthread_mutex_unlock(&pool->mutex);
+  return pool;
+}
+
+void strpool_unref(strpool *pool) {
+  if (!pool)
+    return;
+  pthread_mutex_lock(&pool->mutex);
+  int left = --pool->refcount;
+  pthread_mutex_unlock(&pool->mutex);
+  if (left > 0)
+    return;
+  for (chunk *c = pool->chunks, *next; c; c = next) {
+    next = c->next;
+    free(c);
+  }
+  free(pool->slots);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+static char *pool_alloc(strpool *pool, size_t n) {
+  chunk *c = pool->chunks;
+  if (!c || c->size - c->used < n) {
+    size_t size = n > CHUNK_SIZE ? n : CHUNK_SIZE;
+    c = malloc(sizeof(chunk) + size);
+    if (!c)
+      return NULL;
+    c->used = 0;
+    c->size = size;
+    // An oversized string gets a chunk of its own behind the current one,
+    // so the space left in the current chunk is not abandoned.
+    if (pool->chunks && n > CHUNK_SIZE) {
+      c->next = pool->chunks->next;
+      pool->chunks->next = c;
+    } else {
+      c->next = pool->chunks;
+      pool->chunks = c;
+    }
+  }
+  char *p = c->data + c->used;
+  c->used += n;
+  return p;
+}
+
+static void grow_slots(strpool *pool) {
+  size_t n = pool->num_slots ? pool->num_slots * 2 : MIN_SLOTS;
+  slot *ns = calloc(n, sizeof(slot));
+  if (!ns)
+    return;
+  for (size_t i = 0; i < pool->num_slots; i++) {
+    slot *s = &pool->slots[i];
+    if (!s->str)
+      continue;
+    size_t j = s->hash & (n - 1);
+    while (ns[j].str)
+      j = (j + 1) & (n - 1);
+    ns[j] = *s;
+  }
+  free(pool->slots);
+  pool->slots = ns;
+  pool->num_slots = n;
+}
+
+const char *strpool_intern(strpool *pool, const char *s, size_t len) {
+  if (len == 0)
+    return "";
+  uint32_t h = str_hash(s, len);
+  const char *ret = NULL;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->count * 2 >= pool->num_slots)
+    grow_slots(pool);
+  if (pool->count + 1 >= pool->num_slots)
+    goto out;
+  size_t mask = pool->num_slots - 1, i = h & mask;
+  for (; pool->slots[i].str; i = (i + 1) & mask) {
+    slot *sl = &pool->slots[i];
+    if (sl->hash == h && sl->len == len && memcmp(sl->str, s, len) == 0) {
+      ret = sl->str;
+      goto out;
+    }
+  }
+  char *p = pool_alloc(pool, len + 1);
+  if (!p)
+    goto out;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  pool->slots[i] = (slot){.str = p, .hash = h, .len = len};
+  pool->count++;
+  ret = p;
+out:
+  pthread_mutex_unlock(&pool->mutex);
+  return ret;
+}
+
+const char *strpool_intern_cstr(strpool *pool, const char *s) {
+  return strpool_intern(pool, s, strlen(s));
+}
@@ -0,0 +1,22 @@
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+#include <stddef.h>
+
+/*
+ * Append-only store of interned strings. Each distinct string is kept once
+ * and its address stays valid until the last reference to the pool is
+ * dropped, so index records can hold plain const char * into it. Interning
+ * is thread-safe; reading interned strings needs no locking at all.
+ */
+typedef struct strpool strpool;
+
+strpool *strpool_new(void);
+strpool *strpool_ref(strpool *pool);
+void strpool_unref(strpool *pool);
+// Returns the pooled copy of the first len bytes of s, NUL-terminated, or
+// NULL should the pool run out of memory.
+const char *strpool_intern(strpool *pool, const char *s, size_t len);
+const char *strpool_intern_cstr(strpool *pool, const char *s);
+
+#endif /* STRPOOL_H */
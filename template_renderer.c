@@ -2,6 +2,7 @@
 #include <cJSON.h>
 #include <plutovg.h>
 #include <png.h>
+#include <pthread.h>
 #include <string.h>
 #include <unistd.h>
 #include <zlib.h>
@@ -257,15 +258,21 @@ static bool parse_hex_color(const char *hex, float *r, float *g, float *b,
   return false;
 }
 
+// plutovg is built without C11 threads, so its font faces are neither
+// refcounted atomically nor locked. Canvases that share g_font_cache hold
+// font_mutex for their whole lifetime.
 static plutovg_font_face_cache_t *g_font_cache = NULL;
-static void init_font_cache(void) {
-  if (!g_font_cache) {
-    g_font_cache = plutovg_font_face_cache_create();
-    if (g_font_cache) {
-      plutovg_font_face_cache_load_sys(g_font_cache);
-    }
+static pthread_once_t font_cache_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t font_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void load_font_cache(void) {
+  g_font_cache = plutovg_font_face_cache_create();
+  if (g_font_cache) {
+    plutovg_font_face_cache_load_sys(g_font_cache);
   }
 }
+static void init_font_cache(void) {
+  pthread_once(&font_cache_once, load_font_cache);
+}
 
 static void render_item(cJSON *item, plutovg_canvas_t *canvas, eval_ctx *ctx) {
   if (!item || !cJSON_IsObject(item))
@@ -621,6 +628,7 @@ static unsigned char *render_json_template_to_rgb(const char *json_str,
   }
 
   init_font_cache();
+  pthread_mutex_lock(&font_mutex);
   if (g_font_cache) {
     plutovg_canvas_set_font_face_cache(canvas, g_font_cache);
   }
@@ -639,6 +647,7 @@ static unsigned char *render_json_template_to_rgb(const char *json_str,
   unsigned char *rgb_data = convert_argb_to_rgb(surface, out_w, out_h);
 
   plutovg_canvas_destroy(canvas);
+  pthread_mutex_unlock(&font_mutex);
   plutovg_surface_destroy(surface);
   cJSON_Delete(json);
 
@@ -840,6 +849,7 @@ sds load_template_svg_background(const char *template_dir,
           plutovg_canvas_t *canvas = plutovg_canvas_create(surface);
           if (canvas) {
             init_font_cache();
+            pthread_mutex_lock(&font_mutex);
             if (g_font_cache) {
               plutovg_canvas_set_font_face_cache(canvas, g_font_cache);
             }
@@ -883,6 +893,7 @@ sds load_template_svg_background(const char *template_dir,
               unlink(tmp_path);
             }
             plutovg_canvas_destroy(canvas);
+            pthread_mutex_unlock(&font_mutex);
           }
           plutovg_surface_destroy(surface);
         }